@@ -5,13 +5,45 @@
 #include <SDL.h>
 #include <thread>
 #include <chrono>
+#include <cstring>
+#include <string>
+#include <functional>
+#include <cmath>
+#include <cstdint>
+#include <atomic>
+#include <csignal>
+#include <cerrno>
+#include <map>
+#include <set>
+#include <memory>
+#include <mutex>
+#ifndef _WIN32
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/shm.h>
+#include <sys/ioctl.h>
+#endif
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+#ifdef __SSE2__
+#include <immintrin.h>
+#endif
 
 typedef unsigned char Byte;
 typedef unsigned short Word;
 typedef unsigned int uint;
+typedef unsigned long long Cycles;
 
-int width = 100;
-int height = 64;
+int pixelScale = 12;
 SDL_Window* window;
 SDL_Renderer* renderer;
 SDL_Event e;
@@ -26,7 +58,105 @@ float clockTime = 1.0f;
 // Use clock time or just go as fast as possible
 bool useClockTime = false;
 
-bool running = true;
+// Turbo (fast forward): the CPU ignores clockTime and the display only presents every
+// turboFrameSkip emulated frames or turboPresentRate times a second, whichever comes first
+// Toggled with TAB
+bool turbo = false;
+int turboFrameSkip = 10;
+float turboPresentRate = 30; // (Hz)
+
+// Lockstep: run the CPU and GPU on one thread, executing exactly one frame's worth of cycles
+// then rendering and pacing to the frame rate. Runs are reproducible since emulated time
+// no longer depends on how the two threads get scheduled
+bool lockstep = false;
+
+// No window, frames are still rendered for capture and --terminal
+bool headless = false;
+
+enum class PixelFormat
+{
+    RRGGBB, // 2 bits per channel, top 2 bits unused
+    Indexed // 256 entry palette, see VideoControl
+};
+
+// Where and how the framebuffer is laid out in the address space
+struct VideoMode
+{
+    int width = 100;
+    int height = 64;
+    // Bytes from the start of one row to the next (the address is y << 7 | x by default)
+    int stride = 128;
+    Word base = 0x6000;
+    PixelFormat format = PixelFormat::RRGGBB;
+
+    // Framebuffers the page flip register can pick from, each stride * height bytes after the last
+    int pages = 1;
+
+    int PageSize() const
+    {
+        return stride * height;
+    }
+};
+
+VideoMode videoMode;
+
+// Video timing behind the visible videoMode.width x videoMode.height area
+// Defaults are Ben Eater's VGA circuit: 800x600 @ 60 Hz timings run off a 10 MHz pixel clock (so / 4)
+struct VideoTiming
+{
+    float pixelClock = 10000000; // (Hz)
+
+    // Horizontal timings (pixel clocks)
+    int hVisible = 200;
+    int hFrontPorch = 10;
+    int hSync = 32;
+    int hBackPorch = 22;
+
+    // Vertical timings (lines)
+    int vVisible = 600;
+    int vFrontPorch = 1;
+    int vSync = 4;
+    int vBackPorch = 23;
+
+    int HTotal() const
+    {
+        return hVisible + hFrontPorch + hSync + hBackPorch;
+    }
+
+    int VTotal() const
+    {
+        return vVisible + vFrontPorch + vSync + vBackPorch;
+    }
+
+    // (ms)
+    float FramePeriod() const
+    {
+        return static_cast<float>(HTotal()) * VTotal() / pixelClock * 1000.0f;
+    }
+};
+
+// The video circuit owns the bus during active display and halts the CPU, which only runs in blanking
+// When enabled the frame rate comes from videoTiming instead of frameDelay
+bool emulateVideoTiming = false;
+// Charge the halted time once per scanline or all at once at the start of each frame
+bool haltPerScanline = true;
+VideoTiming videoTiming;
+
+// Written by the SIGINT handler and read by every thread (CPU, GPU, network machines)
+std::atomic<bool> running{true};
+static_assert(std::atomic<bool>::is_always_lock_free, "running is set from a signal handler");
+
+// (ms)
+float FramePeriod()
+{
+    return emulateVideoTiming ? videoTiming.FramePeriod() : frameDelay;
+}
+
+// Emulated frames are FramePeriod() ms of emulated clock time
+Cycles CyclesPerFrame()
+{
+    return std::max(1ull, static_cast<Cycles>(std::lround(FramePeriod() / clockTime)));
+}
 
 struct ROM
 {
@@ -62,923 +192,1271 @@ struct RAM : ROM
     }
 };
 
-struct Bus
+void LoadProgram(ROM* rom, const std::string& path)
 {
-    // TODO: Make modular so that custom PC memory layouts can be created with components (i.e. custom memory map)
-    RAM ram; // 0x0000 - 0x5FFF
-    RAM vram; // 0x6000 - 0x7FFF
-    ROM rom; // 0x8000 - 0xFFFF
+    std::vector<Byte> prg;
+    std::ifstream f;
+    f.open(path, std::ios::binary | std::ios::in);
 
-    Byte ReadByte(const Word addr) const
+    f >> std::noskipws;
+    if (f.fail())
     {
-        if (addr < 0x6000)
-        {
-            return ram.ReadByte(addr);
-        }
-        if (addr < 0x8000)
+        // err
+    }
+
+    while (!f.eof())
+    {
+        Byte b;
+
+        f >> b;
+
+        if (f.fail())
         {
-            // Properly address vram in its relative address space
-            return vram.ReadByte(addr - 0x6000);
+            // err
+            break;
         }
 
-        // Properly address rom in its relative address space
-        return rom.ReadByte(addr - 0x8000);
+        prg.push_back(b);
     }
+    f.close();
+
+    rom->Load(prg);
+}
+
+// Anything on the bus that isn't plain memory (i.e. I/O registers), attached a page at a time
+struct Device
+{
+    virtual ~Device() = default;
+
+    virtual Byte ReadByte(Word addr) = 0;
+    virtual void WriteByte(Word addr, Byte b) = 0;
 
-    void WriteByte(const Word addr, const Byte d)
+    // Read without side effects, for the GPU and debugging
+    virtual Byte Peek(Word)
     {
-        if (addr < 0x6000)
-        {
-            ram.WriteByte(addr, d);
-        }
-        if (addr < 0x8000)
-        {
-            // Properly address vram in its relative address space
-            vram.WriteByte(addr - 0x6000, d);
-        }
+        return 0;
     }
 };
 
-struct CPU6502
+struct Bus
 {
-    bool debug = false; // Determines whether debug text will be printed to the screen
+    // TODO: Make modular so that custom PC memory layouts can be created with components (i.e. custom memory map)
+    RAM ram; // 0x0000 - 0x5FFF (devices are attached at 0x5000 - 0x5FFF, replacing the RAM under their page)
+    RAM vram; // 0x6000 - 0x7FFF
+    ROM rom; // 0x8000 - 0xFFFF
 
-    Bus* bus;
+    static constexpr int PAGE_SIZE = 0x100;
+    static constexpr int NUM_PAGES = 0x100;
 
-    uint numCycles = 0;
+    // Watch flags, a watched page is taken off the fast path so onWatch sees every access to it
+    static constexpr Byte WATCH_READ = 1;
+    static constexpr Byte WATCH_WRITE = 2;
 
-    Word PC = 0xFFFC; // Program Counter
-    Byte SP = 0xFF; // Stack Pointer
+    // Memory behind each page (nullptr for device pages)
+    Byte* memory[NUM_PAGES] = {};
+    bool writable[NUM_PAGES] = {};
+    Byte watch[NUM_PAGES] = {};
+    Device* devices[NUM_PAGES] = {};
 
-    // Registers
-    Byte A = 0; // Accumulator
-    Byte X = 0;
-    Byte Y = 0;
+    // What the fast path uses, a nullptr page goes through ReadSlow/WriteSlow instead
+    Byte* readPages[NUM_PAGES] = {};
+    Byte* writePages[NUM_PAGES] = {};
 
-    // Status Flags
-    bool N = false; // Negative
-    bool V = false; // Overflow
-    bool B = false; // Break
-    bool D = false; // Decimal
-    bool I = false; // Interrupt Disable
-    bool Z = false; // Zero
-    bool C = false; // Carry
+    std::function<void(Word addr, bool write)> onWatch;
 
-    explicit CPU6502(Bus* bus)
+    // Dirty page tracking for undoing writes, a clean page stays off the fast write path until its first write, which
+    // saves what was there. It's by the memory written rather than the page, so banks switched in and out are undone too
+    struct DirtyPage
     {
-        this->bus = bus;
+        int page;
+        Byte* memory;
+        Byte original[PAGE_SIZE];
+    };
+    bool trackDirty = false;
+    bool dirty[NUM_PAGES] = {};
+    std::vector<DirtyPage> dirtyPages;
+
+    Bus()
+    {
+        Map(0x00, 0x60, ram.data, true);
+        Map(0x60, 0x20, vram.data, true);
+        Map(0x80, 0x80, rom.data, false);
     }
 
-    void Clock(const uint c = 1)
+    // Maps count pages starting at page to mem
+    void Map(const int page, const int count, Byte* mem, const bool writable)
     {
-        if (useClockTime) std::this_thread::sleep_for(std::chrono::nanoseconds(static_cast<int>(clockTime * 1000000.0f * c)));
-        numCycles += c;
+        for (int i = 0; i < count; i++)
+        {
+            memory[page + i] = mem + i * PAGE_SIZE;
+            this->writable[page + i] = writable;
+            devices[page + i] = nullptr;
+            // New memory under the page, its first write needs saving too
+            dirty[page + i] = false;
+            Refresh(page + i);
+        }
     }
 
-    void Reset()
+    void Attach(Device* device, const int page, const int count = 1)
     {
-        // ADD CLOCK TIMINGS FOR RESET
-
-        // Set PC to position to read start vector
-        PC = 0xFFFC;
-        // Reset stack pointer to top of stack
-        SP = 0xFF;
+        for (int i = 0; i < count; i++)
+        {
+            memory[page + i] = nullptr;
+            writable[page + i] = false;
+            devices[page + i] = device;
+            Refresh(page + i);
+        }
+    }
 
-        C = N = V = Z = D = I = false;
-        A = X = Y = 0;
+    void SetWatch(const int page, const Byte flags)
+    {
+        watch[page] = flags;
+        Refresh(page);
+    }
 
-        // Read start vector
-        PC = FetchWord();
+    void Refresh(const int page)
+    {
+        readPages[page] = watch[page] & WATCH_READ ? nullptr : memory[page];
+        writePages[page] = watch[page] & WATCH_WRITE || !writable[page] || (trackDirty && !dirty[page]) ? nullptr : memory[page];
     }
 
-    // Converts stack pointer to absolute address
-    Word SPToAddress() const
+    void SetDirtyTracking(const bool enabled)
     {
-        return 0x100 + SP;
+        trackDirty = enabled;
+        ClearDirty();
+        for (int page = 0; page < NUM_PAGES; page++)
+        {
+            Refresh(page);
+        }
     }
 
-    // Fetches next byte at the PC and increments the PC
-    Byte FetchByte()
+    void ClearDirty()
     {
-        return ReadByte(PC++);
+        for (const DirtyPage& d : dirtyPages)
+        {
+            dirty[d.page] = false;
+            Refresh(d.page);
+        }
+        dirtyPages.clear();
     }
 
-    // Fetches next word at the PC in little endian
-    Word FetchWord()
+    // Puts back everything written since tracking started (or the last ClearDirty), newest first so the oldest wins
+    void UndoDirty()
     {
-        Word w = FetchByte();
-        w |= FetchByte() << 8;
-        return w;
+        for (auto d = dirtyPages.rbegin(); d != dirtyPages.rend(); ++d)
+        {
+            memcpy(d->memory, d->original, PAGE_SIZE);
+        }
+        ClearDirty();
     }
 
-    // Gets byte at address
     Byte ReadByte(const Word addr)
     {
-        Clock(1);
-        const Byte b = bus->ReadByte(addr);
-        if (debug) std::cout << std::hex << std::setw(4) << addr << " READ " << std::setw(2) << +b << std::endl;
-        return b;
+        if (const Byte* p = readPages[addr >> 8])
+        {
+            return p[addr & 0xFF];
+        }
+        return ReadSlow(addr);
     }
 
-    // Gets word in little endian at address
-    Word ReadWord(const Word addr)
+    void WriteByte(const Word addr, const Byte b)
     {
-        return ReadByte(addr) + (static_cast<Word>(ReadByte(addr + 1)) << 8);
+        if (Byte* p = writePages[addr >> 8])
+        {
+            p[addr & 0xFF] = b;
+        }
+        else
+        {
+            WriteSlow(addr, b);
+        }
     }
 
-    // Writes byte to address
-    void WriteByte(const Word addr, const Byte b)
+    Byte ReadSlow(const Word addr)
     {
-        bus->WriteByte(addr, b);
-        Clock(1);
-        if (debug) std::cout << std::hex << std::setw(4) << addr << " WRITE " << std::setw(2) << +b << std::endl;
+        const int page = addr >> 8;
+        if (watch[page] & WATCH_READ)
+        {
+            onWatch(addr, false);
+        }
+
+        if (const Byte* p = memory[page])
+        {
+            return p[addr & 0xFF];
+        }
+        if (Device* d = devices[page])
+        {
+            return d->ReadByte(addr);
+        }
+        return 0;
     }
 
-    // Writes word in little endian to address
-    void WriteWord(const Word addr, const Word w)
+    void WriteSlow(const Word addr, const Byte b)
     {
-        WriteByte(addr, w & 0b00001111);
-        WriteByte(addr + 1, w >> 8);
+        const int page = addr >> 8;
+        if (watch[page] & WATCH_WRITE)
+        {
+            onWatch(addr, true);
+        }
+
+        if (Byte* p = memory[page])
+        {
+            if (!writable[page]) return;
+            if (trackDirty && !dirty[page])
+            {
+                dirty[page] = true;
+                dirtyPages.emplace_back();
+                dirtyPages.back().page = page;
+                dirtyPages.back().memory = p;
+                memcpy(dirtyPages.back().original, p, PAGE_SIZE);
+                Refresh(page);
+            }
+            p[addr & 0xFF] = b;
+        }
+        else if (Device* d = devices[page])
+        {
+            d->WriteByte(addr, b);
+        }
     }
 
-    void IRQ()
+    Byte Peek(const Word addr) const
     {
-        if (I == false) {
-            WriteWord(SPToAddress() - 1, PC + 1);
-            SP -= 2;
+        if (const Byte* p = memory[addr >> 8])
+        {
+            return p[addr & 0xFF];
+        }
+        if (Device* d = devices[addr >> 8])
+        {
+            return d->Peek(addr);
+        }
+        return 0;
+    }
 
-            B = false;
-            I = true;
-            PHP();
+    // Writes even read only memory, for the debugger
+    void Poke(const Word addr, const Byte b)
+    {
+        if (Byte* p = memory[addr >> 8])
+        {
+            p[addr & 0xFF] = b;
+        }
+        else if (Device* d = devices[addr >> 8])
+        {
+            d->WriteByte(addr, b);
+        }
+    }
 
-            // Read IRQ interrupt vector
-            PC = ReadWord(0xFFFE);
-            Clock(1);
+    // Copies len bytes starting at addr without side effects, a page at a time where it can
+    void Copy(Byte* dst, Word addr, int len) const
+    {
+        while (len > 0)
+        {
+            const int offset = addr & 0xFF;
+            const int n = std::min(len, PAGE_SIZE - offset);
+            if (const Byte* p = memory[addr >> 8])
+            {
+                memcpy(dst, p + offset, n);
+            }
+            else
+            {
+                for (int i = 0; i < n; i++)
+                {
+                    dst[i] = Peek(addr + i);
+                }
+            }
+            dst += n;
+            addr += n;
+            len -= n;
         }
     }
+};
 
-    void NMI()
+// Lock-free queue between exactly one producer thread and one consumer thread, N must be a power of 2
+template <typename T, uint N>
+struct SpscQueue
+{
+    T items[N];
+    // Only ever increase, written by the consumer and producer respectively
+    std::atomic<uint> head{0};
+    std::atomic<uint> tail{0};
+
+    // Returns false instead of waiting when full
+    bool Push(const T& item)
     {
-        WriteWord(SPToAddress() - 1, PC + 1);
-        SP -= 2;
+        const uint t = tail.load(std::memory_order_relaxed);
+        if (t - head.load(std::memory_order_acquire) == N) return false;
+        items[t % N] = item;
+        tail.store(t + 1, std::memory_order_release);
+        return true;
+    }
 
-        B = false;
-        I = true;
-        PHP();
+    bool Pop(T& item)
+    {
+        const uint h = head.load(std::memory_order_relaxed);
+        if (h == tail.load(std::memory_order_acquire)) return false;
+        item = items[h % N];
+        head.store(h + 1, std::memory_order_release);
+        return true;
+    }
 
-        // Read NMI interrupt vector
-        PC = ReadWord(0xFFFA);
-        Clock(1);
+    bool Empty() const
+    {
+        return head.load(std::memory_order_acquire) == tail.load(std::memory_order_acquire);
     }
 
-    // Executes the number of cycles provided
-    void Execute(const uint cycles)
-    {
-        const int startCycles = numCycles;
-        int deltaCycles = 0;
-        while (deltaCycles < cycles && running)
-        {
-            // clock counts for all instructions include fetching the instruction itself
-            // CHANGE TO MAP
-            switch (FetchByte())
-            {
-                // No addressing mode function call = implied
-                // "ReadByte(Absolute())" means the instruction uses the byte at the supplied address (e.g. ADC, LDA)
-                // "Absolute()" means the instruction uses the address itself (e.g. STA, JMP)
-                // A boolean value in the instruction arguments represents the Accumulator addressing mode
-                case 0xEA:
-                    NOP();
-                    break;
+    bool Full() const
+    {
+        return tail.load(std::memory_order_acquire) - head.load(std::memory_order_acquire) == N;
+    }
+};
 
-                case 0x2C:
-                    BIT(ReadByte(Absolute()));
-                    break;
-                case 0x24:
-                    BIT(ReadByte(ZeroPage()));
-                    break;
+// Runs callbacks at given cycle counts, checked by the CPU between instructions
+struct Scheduler
+{
+    static constexpr Cycles NEVER = ~0ull;
+    static constexpr int MAX_EVENTS = 16;
 
-                case 0xA9:
-                    LDA(Immediate());
-                    break;
-                case 0xAD:
-                    LDA(ReadByte(Absolute()));
-                    break;
-                case 0xA5:
-                    LDA(ReadByte(ZeroPage()));
-                    break;
-                case 0xB5:
-                    LDA(ReadByte(ZeroPageX()));
-                    break;
-                case 0xBD:
-                    LDA(ReadByte(AbsoluteX()));
-                    break;
-                case 0xB9:
-                    LDA(ReadByte(AbsoluteY()));
-                    break;
-                case 0xA1:
-                    LDA(ReadByte(IndirectX()));
-                    break;
-                case 0xB1:
-                    LDA(ReadByte(IndirectY()));
-                    break;
+    struct Event
+    {
+        Cycles when = NEVER;
+        std::function<void(Cycles)> callback;
+    };
 
-                case 0xA2:
-                    LDX(Immediate());
-                    break;
-                case 0xAE:
-                    LDX(ReadByte(Absolute()));
-                    break;
-                case 0xA6:
-                    LDX(ReadByte(ZeroPage()));
-                    break;
-                case 0xB6:
-                    LDX(ReadByte(ZeroPageY()));
-                    break;
-                case 0xBE:
-                    LDX(ReadByte(AbsoluteY()));
-                    break;
+    Event events[MAX_EVENTS];
+    int numEvents = 0;
 
-                case 0xA0:
-                    LDY(Immediate());
-                    break;
-                case 0xAC:
-                    LDY(ReadByte(Absolute()));
-                    break;
-                case 0xA4:
-                    LDY(ReadByte(ZeroPage()));
-                    break;
-                case 0xB4:
-                    LDY(ReadByte(ZeroPageX()));
-                    break;
-                case 0xBC:
-                    LDY(ReadByte(AbsoluteX()));
-                    break;
+    // Earliest pending event so the CPU only has to do one compare per instruction
+    Cycles next = NEVER;
 
-                case 0x8D:
-                    STA(Absolute());
-                    break;
-                case 0x85:
-                    STA(ZeroPage());
-                    break;
-                case 0x95:
-                    STA(ZeroPageX());
-                    break;
-                case 0x9D:
-                    STA(AbsoluteX());
-                    break;
-                case 0x99:
-                    STA(AbsoluteY());
-                    break;
-                case 0x81:
-                    STA(IndirectX());
-                    break;
-                case 0x91:
-                    STA(IndirectY());
-                    break;
+    // Returns an id to (re)schedule the callback with
+    int Add(std::function<void(Cycles)> callback)
+    {
+        events[numEvents].callback = std::move(callback);
+        return numEvents++;
+    }
 
-                case 0x8E:
-                    STX(Absolute());
-                    break;
-                case 0x86:
-                    STX(ZeroPage());
-                    break;
-                case 0x96:
-                    STX(ZeroPageY());
-                    break;
+    void Schedule(const int id, const Cycles when)
+    {
+        events[id].when = when;
+        next = std::min(next, when);
+    }
 
-                case 0x8C:
-                    STY(Absolute());
-                    break;
-                case 0x84:
-                    STY(ZeroPage());
-                    break;
-                case 0x94:
-                    STY(ZeroPageX());
-                    break;
+    void Cancel(const int id)
+    {
+        events[id].when = NEVER;
+        Update();
+    }
 
-                case 0xAA:
-                    TAX();
-                    break;
+    void Update()
+    {
+        next = NEVER;
+        for (int i = 0; i < numEvents; i++)
+        {
+            next = std::min(next, events[i].when);
+        }
+    }
 
-                case 0xA8:
-                    TAY();
-                    break;
+    // Fires every event due at now, callbacks are free to schedule themselves again
+    void Run(const Cycles now)
+    {
+        for (int i = 0; i < numEvents; i++)
+        {
+            if (events[i].when <= now)
+            {
+                events[i].when = NEVER;
+                events[i].callback(now);
+            }
+        }
+        Update();
+    }
+};
 
-                case 0xBA:
-                    TSX();
-                    break;
+// Record/replay of everything that reaches the machine from outside (--record=<file>, --replay=<file>)
+// Devices take host input through Input() at cycles the emulation decides (i.e. the ACIA's receive events), so logging
+// what arrived and when is enough to replay a run exactly. Interrupt line changes follow from the inputs; they're logged
+// too and compared on replay to catch divergence early. The log is "6502RPL1" then entries of
+// varint(cycles since the previous entry), type byte, varint(value), ending with an End entry where the run stopped
+struct InputLog
+{
+    enum Type : Byte { End, Serial, Irq, Nmi, Key, NUM_TYPES };
 
-                case 0x8A:
-                    TXA();
-                    break;
+    struct Entry
+    {
+        Cycles when;
+        Type type;
+        uint value;
+    };
 
-                case 0x9A:
-                    TXS();
-                    break;
+    static constexpr char MAGIC[8] = { '6', '5', '0', '2', 'R', 'P', 'L', '1' };
 
-                case 0x98:
-                    TYA();
-                    break;
+    bool recording = false;
+    bool replaying = false;
 
-                case 0x48:
-                    PHA();
-                    break;
+    // Recording: encoded entries waiting to be written out
+    std::ofstream out;
+    std::vector<Byte> buffer;
+    Cycles last = 0;
+    uint64_t count = 0;
 
-                case 0x68:
-                    PLA();
-                    break;
-
-                case 0x08:
-                    PHP();
-                    break;
-
-                case 0x28:
-                    PLP();
-                    break;
-
-                case 0xEE:
-                    INC(Absolute());
-                    break;
-                case 0xE6:
-                    INC(ZeroPage());
-                    break;
-                case 0xF6:
-                    INC(ZeroPageX());
-                    break;
-                case 0xFE:
-                    INC(AbsoluteX());
-                    break;
-
-                case 0xE8:
-                    INX();
-                    break;
+    // Replaying: the whole log, with where each type is up to
+    std::vector<Entry> entries;
+    size_t cursors[NUM_TYPES] = {};
+    Cycles end = 0;
+    bool diverged = false;
 
-                case 0xC8:
-                    INY();
-                    break;
-
-                case 0xCE:
-                    DEC(Absolute());
-                    break;
-                case 0xC6:
-                    DEC(ZeroPage());
-                    break;
-                case 0xD6:
-                    DEC(ZeroPageX());
-                    break;
-                case 0xDE:
-                    DEC(AbsoluteX());
-                    break;
+    bool Record(const std::string& path)
+    {
+        out.open(path, std::ios::binary);
+        if (!out.is_open()) return false;
+        out.write(MAGIC, sizeof(MAGIC));
+        recording = true;
+        return true;
+    }
 
-                case 0xCA:
-                    DEX();
-                    break;
+    bool Replay(const std::string& path)
+    {
+        std::ifstream f(path, std::ios::binary);
+        const std::vector<Byte> data((std::istreambuf_iterator<char>(f)), std::istreambuf_iterator<char>());
+        if (data.size() < sizeof(MAGIC) || memcmp(data.data(), MAGIC, sizeof(MAGIC)) != 0) return false;
 
-                case 0x88:
-                    DEY();
-                    break;
+        size_t i = sizeof(MAGIC);
+        Cycles when = 0;
+        while (i < data.size())
+        {
+            Entry e;
+            when += ReadVarint(data, i);
+            e.when = when;
+            e.type = i < data.size() ? static_cast<Type>(data[i++]) : End;
+            e.value = static_cast<uint>(ReadVarint(data, i));
+            if (e.type >= NUM_TYPES) return false;
+            entries.push_back(e);
+            if (e.type == End) break;
+        }
+        if (entries.empty() || entries.back().type != End) return false;
+        end = entries.back().when;
 
-                case 0x29:
-                    AND(Immediate());
-                    break;
-                case 0x2D:
-                    AND(ReadByte(Absolute()));
-                    break;
-                case 0x25:
-                    AND(ReadByte(ZeroPage()));
-                    break;
-                case 0x35:
-                    AND(ReadByte(ZeroPageX()));
-                    break;
-                case 0x3D:
-                    AND(ReadByte(AbsoluteX()));
-                    break;
-                case 0x39:
-                    AND(ReadByte(AbsoluteY()));
-                    break;
-                case 0x21:
-                    AND(ReadByte(IndirectX()));
-                    break;
-                case 0x31:
-                    AND(ReadByte(IndirectY()));
-                    break;
+        replaying = true;
+        return true;
+    }
 
-                case 0x09:
-                    ORA(Immediate());
-                    break;
-                case 0x0D:
-                    ORA(ReadByte(Absolute()));
-                    break;
-                case 0x05:
-                    ORA(ReadByte(ZeroPage()));
-                    break;
-                case 0x15:
-                    ORA(ReadByte(ZeroPageX()));
-                    break;
-                case 0x1D:
-                    ORA(ReadByte(AbsoluteX()));
-                    break;
-                case 0x19:
-                    ORA(ReadByte(AbsoluteY()));
-                    break;
-                case 0x01:
-                    ORA(ReadByte(IndirectX()));
-                    break;
-                case 0x11:
-                    ORA(ReadByte(IndirectY()));
-                    break;
+    // Stops the run where the recording stopped
+    void Attach(Scheduler* scheduler) const
+    {
+        if (!replaying) return;
+        scheduler->Schedule(scheduler->Add([](Cycles) { running = false; }), end);
+    }
 
-                case 0x49:
-                    EOR(Immediate());
-                    break;
-                case 0x4D:
-                    EOR(ReadByte(Absolute()));
-                    break;
-                case 0x45:
-                    EOR(ReadByte(ZeroPage()));
-                    break;
-                case 0x55:
-                    EOR(ReadByte(ZeroPageX()));
-                    break;
-                case 0x5D:
-                    EOR(ReadByte(AbsoluteX()));
-                    break;
-                case 0x59:
-                    EOR(ReadByte(AbsoluteY()));
-                    break;
-                case 0x41:
-                    EOR(ReadByte(IndirectX()));
-                    break;
-                case 0x51:
-                    EOR(ReadByte(IndirectY()));
-                    break;
+    static uint64_t ReadVarint(const std::vector<Byte>& data, size_t& i)
+    {
+        uint64_t v = 0;
+        for (int shift = 0; i < data.size() && shift < 64; shift += 7)
+        {
+            const Byte b = data[i++];
+            v |= static_cast<uint64_t>(b & 0x7F) << shift;
+            if (!(b & 0x80)) break;
+        }
+        return v;
+    }
 
-                case 0xC9:
-                    CMP(Immediate());
-                    break;
-                case 0xCD:
-                    CMP(ReadByte(Absolute()));
-                    break;
-                case 0xC5:
-                    CMP(ReadByte(ZeroPage()));
-                    break;
-                case 0xD5:
-                    CMP(ReadByte(ZeroPageX()));
-                    break;
-                case 0xDD:
-                    CMP(ReadByte(AbsoluteX()));
-                    break;
-                case 0xD9:
-                    CMP(ReadByte(AbsoluteY()));
-                    break;
-                case 0xC1:
-                    CMP(ReadByte(IndirectX()));
-                    break;
-                case 0xD1:
-                    CMP(ReadByte(IndirectY()));
-                    break;
+    void WriteVarint(uint64_t v)
+    {
+        while (v >= 0x80)
+        {
+            buffer.push_back(static_cast<Byte>(v | 0x80));
+            v >>= 7;
+        }
+        buffer.push_back(static_cast<Byte>(v));
+    }
 
-                case 0xE0:
-                    CPX(Immediate());
-                    break;
-                case 0xEC:
-                    CPX(ReadByte(Absolute()));
-                    break;
-                case 0xE4:
-                    CPX(ReadByte(ZeroPage()));
-                    break;
+    void Append(const Type type, const Cycles now, const uint value)
+    {
+        WriteVarint(now - last);
+        buffer.push_back(type);
+        WriteVarint(value);
+        last = now;
+        count++;
 
-                case 0xC0:
-                    CPY(Immediate());
-                    break;
-                case 0xCC:
-                    CPY(ReadByte(Absolute()));
-                    break;
-                case 0xC4:
-                    CPY(ReadByte(ZeroPage()));
-                    break;
+        if (buffer.size() >= 65536) Flush();
+    }
 
-                case 0x0A:
-                    ASL(0x00, true);
-                    break;
-                case 0x0E:
-                    ASL(Absolute(), false);
-                    break;
-                case 0x06:
-                    ASL(ZeroPage(), false);
-                    break;
-                case 0x16:
-                    ASL(ZeroPageX(), false);
-                    break;
-                case 0x1E:
-                    ASL(AbsoluteX(), false);
-                    break;
+    void Flush()
+    {
+        out.write(reinterpret_cast<const char*>(buffer.data()), buffer.size());
+        buffer.clear();
+    }
 
-                case 0x4A:
-                    LSR(0x00, true);
-                    break;
-                case 0x4E:
-                    LSR(Absolute(), false);
-                    break;
-                case 0x46:
-                    LSR(ZeroPage(), false);
-                    break;
-                case 0x56:
-                    LSR(ZeroPageX(), false);
-                    break;
-                case 0x5E:
-                    LSR(AbsoluteX(), false);
-                    break;
+    // Host input: while recording, whatever source gives is logged; while replaying, source is ignored and
+    // the logged value for exactly this cycle comes back instead
+    template <typename Source>
+    bool Input(const Type type, const Cycles now, uint& value, Source source)
+    {
+        if (replaying)
+        {
+            size_t& i = cursors[type];
+            for (;; i++)
+            {
+                while (i < entries.size() && entries[i].type != type) i++;
+                if (i == entries.size() || entries[i].when >= now) break;
+                // Nothing asked for this one at its cycle, so the run has already gone differently
+                Diverge(type, entries[i].when, entries[i].value);
+            }
+            if (i == entries.size() || entries[i].when != now) return false;
+            value = entries[i++].value;
+            return true;
+        }
+        if (!source(value)) return false;
+        if (recording) Append(type, now, value);
+        return true;
+    }
 
-                case 0x2A:
-                    ROL(0x00, true);
-                    break;
-                case 0x2E:
-                    ROL(Absolute(), false);
-                    break;
-                case 0x26:
-                    ROL(ZeroPage(), false);
-                    break;
-                case 0x36:
-                    ROL(ZeroPageX(), false);
-                    break;
-                case 0x3E:
-                    ROL(AbsoluteX(), false);
-                    break;
+    // Emulated state that follows from the inputs, logged while recording and compared while replaying
+    void Check(const Type type, const Cycles now, const uint value)
+    {
+        if (recording)
+        {
+            Append(type, now, value);
+            return;
+        }
+        if (!replaying || diverged) return;
 
-                case 0x6A:
-                    ROR(0x00, true);
-                    break;
-                case 0x6E:
-                    ROR(Absolute(), false);
-                    break;
-                case 0x66:
-                    ROR(ZeroPage(), false);
-                    break;
-                case 0x76:
-                    ROR(ZeroPageX(), false);
-                    break;
-                case 0x7E:
-                    ROR(AbsoluteX(), false);
-                    break;
+        size_t& i = cursors[type];
+        while (i < entries.size() && entries[i].type != type) i++;
+        if (i < entries.size() && entries[i].when == now && entries[i].value == value)
+        {
+            i++;
+            return;
+        }
 
-                case 0x4C:
-                    JMP(Absolute());
-                    break;
-                case 0x6C:
-                    JMP(Indirect());
-                    break;
+        Diverge(type, now, value);
+    }
 
-                case 0x20:
-                    JSR(Absolute());
-                    break;
+    void Diverge(const Type type, const Cycles when, const uint value)
+    {
+        if (diverged) return;
+        diverged = true;
+        std::cout << "Replay diverged at cycle " << std::dec << when << " (type " << +type << " value " << value << ")" << std::endl;
+    }
 
-                case 0x60:
-                    RTS();
-                    break;
+    void Close(const Cycles now)
+    {
+        if (recording)
+        {
+            Append(End, now, 0);
+            Flush();
+            out.close();
+            std::cout << "Recorded " << std::dec << count - 1 << " inputs over " << now << " cycles" << std::endl;
+            recording = false;
+        }
+        if (replaying)
+        {
+            std::cout << "Replayed " << std::dec << entries.size() - 1 << " inputs over " << now << " cycles" << (diverged ? ", diverged" : "") << std::endl;
+            replaying = false;
+        }
+    }
+};
 
-                case 0xF0:
-                    BEQ(Relative());
-                    break;
+// Symbols and source lines for addresses, from ca65/ld65 debug info (ld65 --dbgfile) and VICE label files
+// Both are kept sorted by address so a lookup is a binary search
+struct DebugInfo
+{
+    struct Range
+    {
+        uint start;
+        uint size;
+    };
 
-                case 0xD0:
-                    BNE(Relative());
-                    break;
+    struct Line
+    {
+        int file;
+        int line;
+        int type; // 0 = assembly, 1 = C, 2 = macro expansion
+        std::vector<Range> ranges;
+    };
+
+    // Names live in one pool so the index itself is just 8 bytes a symbol
+    struct Symbol
+    {
+        Word addr;
+        uint name;
+    };
 
-                case 0xB0:
-                    BCS(Relative());
-                    break;
+    struct LineRange
+    {
+        uint start;
+        uint end;
+        uint line;
+    };
+
+    std::vector<std::string> files;
+    std::vector<Line> lines;
+    std::vector<Symbol> symbols;
+    std::vector<LineRange> lineIndex;
+    std::string names;
+
+    // Splits "key=value,key="quoted, value",..." into pairs
+    static std::map<std::string, std::string> Fields(const std::string& s)
+    {
+        std::map<std::string, std::string> fields;
+        size_t i = 0;
+        while (i < s.size())
+        {
+            const size_t eq = s.find('=', i);
+            if (eq == std::string::npos) break;
+            const std::string key = s.substr(i, eq - i);
 
-                case 0x90:
-                    BCC(Relative());
-                    break;
+            std::string value;
+            i = eq + 1;
+            if (i < s.size() && s[i] == '"')
+            {
+                for (i++; i < s.size() && s[i] != '"'; i++)
+                {
+                    if (s[i] == '\\' && i + 1 < s.size()) i++;
+                    value += s[i];
+                }
+                i++;
+            }
+            else
+            {
+                const size_t comma = std::min(s.find(',', i), s.size());
+                value = s.substr(i, comma - i);
+                i = comma;
+            }
+            fields[key] = value;
 
-                case 0x10:
-                    BPL(Relative());
-                    break;
+            // Past the comma
+            i++;
+        }
+        return fields;
+    }
 
-                case 0x30:
-                    BMI(Relative());
-                    break;
+    void AddSymbol(const Word addr, const std::string& name)
+    {
+        symbols.push_back(Symbol { addr, static_cast<uint>(names.size()) });
+        names += name;
+        names += '\0';
+    }
 
-                case 0x50:
-                    BVC(Relative());
-                    break;
+    bool Load(const std::string& path)
+    {
+        std::ifstream f(path);
+        if (!f.is_open()) return false;
 
-                case 0x07:
-                    BVS(Relative());
-                    break;
+        // Lines come before the segments and spans they refer to, so they're resolved at the end
+        struct Span
+        {
+            uint seg;
+            uint start;
+            uint size;
+        };
+        std::vector<uint> segStarts;
+        std::vector<Span> spans;
+        std::vector<std::string> lineSpans;
+        const size_t firstLine = lines.size();
+
+        const auto number = [](const std::map<std::string, std::string>& fields, const char* key) -> uint
+        {
+            const auto it = fields.find(key);
+            return it == fields.end() ? 0 : std::stoul(it->second, nullptr, 0);
+        };
+        const auto put = [](auto& v, const uint id, const auto& item)
+        {
+            if (v.size() <= id) v.resize(id + 1);
+            v[id] = item;
+        };
 
-                case 0x00:
-                    BRK();
-                    break;
+        std::string record;
+        while (std::getline(f, record))
+        {
+            const size_t tab = record.find('\t');
+            if (tab == std::string::npos) continue;
+            const std::string type = record.substr(0, tab);
+            const auto fields = Fields(record.substr(tab + 1));
+            const uint id = number(fields, "id");
 
-                case 0x40:
-                    RTI();
-                    break;
+            if (type == "file")
+            {
+                put(files, id, fields.count("name") ? fields.at("name") : std::string());
+            }
+            else if (type == "seg")
+            {
+                put(segStarts, id, number(fields, "start"));
+            }
+            else if (type == "span")
+            {
+                put(spans, id, Span { number(fields, "seg"), number(fields, "start"), number(fields, "size") });
+            }
+            else if (type == "line" && fields.count("span"))
+            {
+                put(lines, firstLine + id, Line { static_cast<int>(number(fields, "file")), static_cast<int>(number(fields, "line")), static_cast<int>(number(fields, "type")), {} });
+                put(lineSpans, id, fields.at("span"));
+            }
+            else if (type == "sym" && fields.count("val") && fields.count("name"))
+            {
+                // Only labels, equates are mostly constants rather than addresses
+                const auto kind = fields.find("type");
+                if (kind == fields.end() || kind->second == "lab") AddSymbol(number(fields, "val"), fields.at("name"));
+            }
+        }
 
-                case 0x18:
-                    CLC();
-                    break;
+        for (size_t i = 0; i < lineSpans.size(); i++)
+        {
+            // Span lists are joined with +
+            size_t start = 0;
+            while (start < lineSpans[i].size())
+            {
+                const size_t plus = std::min(lineSpans[i].find('+', start), lineSpans[i].size());
+                const uint id = std::stoul(lineSpans[i].substr(start, plus - start));
+                if (id < spans.size() && spans[id].seg < segStarts.size())
+                {
+                    lines[firstLine + i].ranges.push_back(Range { segStarts[spans[id].seg] + spans[id].start, spans[id].size });
+                }
+                start = plus + 1;
+            }
+        }
 
-                case 0x38:
-                    SEC();
-                    break;
+        Sort();
+        return true;
+    }
 
-                case 0xD8:
-                    CLD();
-                    break;
+    // VICE monitor labels, "al C:8000 .main" a line
+    bool LoadLabels(const std::string& path)
+    {
+        std::ifstream f(path);
+        if (!f.is_open()) return false;
 
-                case 0xF8:
-                    SED();
-                    break;
+        std::string command, addr, name;
+        while (f >> command >> addr >> name)
+        {
+            if (command != "al") continue;
+            if (addr.rfind("C:", 0) == 0) addr = addr.substr(2);
+            if (name[0] == '.') name = name.substr(1);
+            AddSymbol(static_cast<Word>(std::stoul(addr, nullptr, 16)), name);
+        }
 
-                case 0x58:
-                    CLI();
-                    break;
+        Sort();
+        return true;
+    }
 
-                case 0x78:
-                    SEI();
-                    break;
+    void Sort()
+    {
+        // The first name loaded for an address wins
+        std::stable_sort(symbols.begin(), symbols.end(), [](const Symbol& a, const Symbol& b) { return a.addr < b.addr; });
+        symbols.erase(std::unique(symbols.begin(), symbols.end(), [](const Symbol& a, const Symbol& b) { return a.addr == b.addr; }), symbols.end());
 
-                case 0xB8:
-                    CLV();
-                    break;
+        // Macro expansions and C lines cover the same bytes as assembly lines, those are what's wanted
+        lineIndex.clear();
+        for (uint i = 0; i < lines.size(); i++)
+        {
+            if (lines[i].type == 2) continue;
+            for (const Range& range : lines[i].ranges)
+            {
+                if (range.size > 0) lineIndex.push_back(LineRange { range.start, range.start + range.size, i });
+            }
+        }
+        std::sort(lineIndex.begin(), lineIndex.end(), [](const LineRange& a, const LineRange& b) { return a.start < b.start; });
+    }
 
-                case 0x69:
-                    ADC(Immediate());
-                    break;
-                case 0x6D:
-                    ADC(ReadByte(Absolute()));
-                    break;
-                case 0x65:
-                    ADC(ReadByte(ZeroPage()));
-                    break;
-                case 0x75:
-                    ADC(ReadByte(ZeroPageX()));
-                    break;
-                case 0x7D:
-                    ADC(ReadByte(AbsoluteX()));
-                    break;
-                case 0x79:
-                    ADC(ReadByte(AbsoluteY()));
-                    break;
-                case 0x61:
-                    ADC(ReadByte(IndirectX()));
-                    break;
-                case 0x71:
-                    ADC(ReadByte(IndirectY()));
-                    break;
+    bool Empty() const
+    {
+        return symbols.empty() && lineIndex.empty();
+    }
 
-                case 0xE9:
-                    SBC(Immediate());
-                    break;
-                case 0xED:
-                    SBC(ReadByte(Absolute()));
-                    break;
-                case 0xE5:
-                    SBC(ReadByte(ZeroPage()));
-                    break;
-                case 0xF5:
-                    SBC(ReadByte(ZeroPageX()));
-                    break;
-                case 0xFD:
-                    SBC(ReadByte(AbsoluteX()));
-                    break;
-                case 0xF9:
-                    SBC(ReadByte(AbsoluteY()));
-                    break;
-                case 0xE1:
-                    SBC(ReadByte(IndirectX()));
-                    break;
-                case 0xF1:
-                    SBC(ReadByte(IndirectY()));
-                    break;
+    // Closest symbol at or below addr
+    const Symbol* FindSymbol(const Word addr) const
+    {
+        const auto it = std::upper_bound(symbols.begin(), symbols.end(), addr, [](const Word a, const Symbol& s) { return a < s.addr; });
+        return it == symbols.begin() ? nullptr : &*(it - 1);
+    }
 
-                default:
-                    std::cout << "Instruction not recognized" << std::endl;
+    // Symbol by name, for the debugger (not fast)
+    bool FindAddress(const std::string& name, Word& addr) const
+    {
+        for (const Symbol& s : symbols)
+        {
+            if (name == names.c_str() + s.name)
+            {
+                addr = s.addr;
+                return true;
             }
-            // std::cout << std::hex << std::setw(2) << +bus->ram.data[0x0001] << +bus->ram.data[0x0000] << std::endl;
-            deltaCycles = numCycles - startCycles;
         }
+        return false;
     }
 
-    // Addressing mode helpers (Implied and Accumulator are one byte instructions so no function required)
-    Byte Immediate()
+    const Line* FindLine(const Word addr) const
     {
-        return FetchByte();
+        const auto it = std::upper_bound(lineIndex.begin(), lineIndex.end(), addr, [](const Word a, const LineRange& r) { return a < r.start; });
+        if (it == lineIndex.begin() || addr >= (it - 1)->end) return nullptr;
+        return &lines[(it - 1)->line];
     }
 
-    Word Absolute()
+    // "routine+offset", or just the address if nothing comes before it
+    std::string Symbolize(const Word addr) const
     {
-        return FetchWord();
+        char s[16];
+        const Symbol* symbol = FindSymbol(addr);
+        if (symbol == nullptr)
+        {
+            snprintf(s, sizeof(s), "$%04X", addr);
+            return s;
+        }
+        if (symbol->addr == addr) return names.c_str() + symbol->name;
+
+        snprintf(s, sizeof(s), "+%u", addr - symbol->addr);
+        return names.c_str() + symbol->name + std::string(s);
     }
 
-    Word AbsoluteX()
+    // "file:line", empty if addr isn't in the line table
+    std::string Source(const Word addr) const
     {
-        const Word addr = FetchWord();
+        const Line* line = FindLine(addr);
+        if (line == nullptr) return "";
+        return (line->file < static_cast<int>(files.size()) ? files[line->file] : "?") + ":" + std::to_string(line->line);
+    }
+};
+
+#ifdef HEATMAP
+// Build with -DHEATMAP to count reads, writes and instruction fetches for every address
+// Plain increments from the CPU thread only, the overlay just reads whatever is there
+struct Heatmap
+{
+    uint32_t reads[0x10000] = {};
+    uint32_t writes[0x10000] = {};
+    uint32_t executes[0x10000] = {};
 
-        if ((addr & 0x00FF) + X > 0x00FF)
+    // Deepest the stack has been, from the lowest address written in page 1 (bytes)
+    int StackPeak() const
+    {
+        for (int addr = 0x100; addr < 0x200; addr++)
         {
-            Clock(1);
+            if (writes[addr] != 0) return 0x200 - addr;
         }
-
-        return addr + X;
+        return 0;
     }
 
-    Word AbsoluteY()
+    // Instructions executed per routine, the busiest first
+    void Profile(const DebugInfo& debugInfo, std::ostream& out, const size_t top = 20) const
     {
-        const Word addr = FetchWord();
-
-        if ((addr & 0x00FF) + Y > 0x00FF)
+        std::vector<std::pair<uint64_t, Word>> routines;
+        for (uint addr = 0; addr < 0x10000; addr++)
         {
-            Clock(1);
+            if (executes[addr] == 0) continue;
+            const DebugInfo::Symbol* symbol = debugInfo.FindSymbol(addr);
+            const Word start = symbol == nullptr ? 0 : symbol->addr;
+            if (routines.empty() || routines.back().second != start) routines.push_back({ 0, start });
+            routines.back().first += executes[addr];
         }
 
-        return addr + Y;
+        std::sort(routines.begin(), routines.end(), [](const auto& a, const auto& b) { return a.first > b.first; });
+        for (size_t i = 0; i < routines.size() && i < top; i++)
+        {
+            out << std::dec << std::setfill(' ') << std::setw(12) << routines[i].first << "  " << debugInfo.Symbolize(routines[i].second) << std::endl;
+        }
+        out << std::setfill('0');
     }
 
-    Word ZeroPage()
+    // "HEAT" then reads, writes and executes, 0x10000 little endian uint32s each
+    bool Dump(const std::string& path) const
     {
-        return 0x00FF & FetchByte();
+        std::ofstream f(path, std::ios::binary | std::ios::out);
+        if (!f.is_open()) return false;
+
+        f.write("HEAT", 4);
+        f.write(reinterpret_cast<const char*>(reads), sizeof(reads));
+        f.write(reinterpret_cast<const char*>(writes), sizeof(writes));
+        f.write(reinterpret_cast<const char*>(executes), sizeof(executes));
+        return true;
     }
+};
+#endif
 
-    Word ZeroPageX()
+// Hit counts for Coverage, a global so libFuzzer can pick it up as extra counters
+#ifdef LIBFUZZER
+__attribute__((section("__libfuzzer_extra_counters")))
+#endif
+Byte coverageMap[0x10000];
+
+// AFL-style edge coverage, a 64KiB map of hit counts indexed by a hash of the previous and current branch target
+// The CPU bumps it at branches (taken or not), jumps, calls, returns and interrupts
+struct Coverage
+{
+    static constexpr int MAP_SIZE = 0x10000;
+
+    Byte* map = coverageMap;
+    Word previous = 0;
+
+    // PCs that started an instruction, for exporting line coverage
+    uint64_t executed[0x10000 / 64] = {};
+
+    void Edge(const Word target)
     {
-        Clock(1);
-        return 0x00FF & FetchByte() + X;
+        // Odd multiplier so every target lands somewhere different
+        const Word location = static_cast<Word>(target * 0x9E37u);
+        Byte& counter = map[location ^ previous];
+        // Skips 0 when it wraps so a hot edge never looks unvisited
+        counter += 1 + (counter == 0xFF);
+        previous = location >> 1;
     }
 
-    Word ZeroPageY()
+    void Executed(const Word pc)
     {
-        Clock(1);
-        return 0x00FF & FetchByte() + Y;
+        executed[pc >> 6] |= 1ull << (pc & 63);
     }
 
-    Word Indirect()
+    bool WasExecuted(const Word pc) const
     {
-        return ReadWord(FetchWord());
+        return executed[pc >> 6] >> (pc & 63) & 1;
     }
 
-    Word IndirectX()
+#ifndef _WIN32
+    // Uses afl-fuzz's shared map when there is one, it needs to be at least 64KiB (AFL_MAP_SIZE=65536)
+    bool OpenShared()
     {
-        return ReadWord(ZeroPageX());
-    }
+        const char* id = getenv("__AFL_SHM_ID");
+        if (id == nullptr) return false;
 
-    Word IndirectY()
+        void* p = shmat(atoi(id), nullptr, 0);
+        if (p == reinterpret_cast<void*>(-1)) return false;
+        map = static_cast<Byte*>(p);
+        return true;
+    }
+#else
+    bool OpenShared()
     {
-        const Word addr = ReadWord(ZeroPage());
-        if ((addr & 0x00FF) + Y > 0x00FF)
-        {
-            Clock(1);
-        }
-        return addr + Y;
+        return false;
     }
+#endif
+};
 
-    Word Relative()
+// Macro-op fusion for the fast core: pairs of instructions the firmware runs back to back all the time, run as one
+// superinstruction with a single dispatch and a single trip round Execute's loop (see CPU6502::StepFused)
+// Which pairs are fused comes from counting executed opcode pairs, --fuse=auto (default) counts the first
+// PROFILE_INSTRUCTIONS and then turns on the fusible pairs that made up at least THRESHOLD of them,
+// --fuse=all turns them all on from the start and --fuse=off leaves the core alone
+// --pair-profile=<file> counts for the whole run and writes the most common pairs out at the end
+struct Fusion
+{
+    struct Pair
+    {
+        Byte first;
+        Byte second;
+        Byte length; // Of the first instruction
+        const char* name;
+    };
+
+    static constexpr Pair PAIRS[] = {
+        // Loop counters
+        { 0xCA, 0xD0, 1, "DEX BNE" },
+        { 0x88, 0xD0, 1, "DEY BNE" },
+        { 0xE8, 0xD0, 1, "INX BNE" },
+        { 0xC8, 0xD0, 1, "INY BNE" },
+        // Copies
+        { 0xA9, 0x85, 2, "LDA # STA zp" },
+        { 0xA9, 0x8D, 2, "LDA # STA abs" },
+        { 0xA5, 0x85, 2, "LDA zp STA zp" },
+        { 0xA5, 0x8D, 2, "LDA zp STA abs" },
+        { 0xAD, 0x85, 3, "LDA abs STA zp" },
+        { 0xAD, 0x8D, 3, "LDA abs STA abs" },
+        // Tests
+        { 0xC9, 0xF0, 2, "CMP # BEQ" },
+        { 0xC9, 0xD0, 2, "CMP # BNE" },
+        { 0xE0, 0xF0, 2, "CPX # BEQ" },
+        { 0xE0, 0xD0, 2, "CPX # BNE" },
+        { 0xC0, 0xF0, 2, "CPY # BEQ" },
+        { 0xC0, 0xD0, 2, "CPY # BNE" },
+        // Block moves
+        { 0xB1, 0x91, 2, "LDA (zp),Y STA (zp),Y" },
+        { 0xB1, 0x99, 2, "LDA (zp),Y STA abs,Y" },
+        { 0xB9, 0x99, 3, "LDA abs,Y STA abs,Y" },
+        { 0xBD, 0x9D, 3, "LDA abs,X STA abs,X" },
+    };
+
+    enum Mode { Off, Auto, All };
+
+    static constexpr uint64_t PROFILE_INSTRUCTIONS = 1000000;
+    static constexpr double THRESHOLD = 0.005;
+
+    Mode mode = Auto;
+
+    // Length of the first instruction for opcodes that start an enabled pair (0 for none) and a bit per enabled pair
+    Byte lengths[256] = {};
+    uint64_t enabled[0x10000 / 64] = {};
+
+    // Executed pairs by first << 8 | second while counting
+    std::vector<uint64_t> counts;
+    uint64_t counted = 0;
+    bool counting = false;
+    bool keepCounting = false; // For --pair-profile, otherwise it stops once auto has chosen
+    Byte last = 0;
+
+    void Start(const Mode mode, const bool profile)
     {
-        Word rel = ZeroPage();
+        this->mode = mode;
+        keepCounting = profile;
+        counting = mode == Auto || profile;
+        if (counting) counts.assign(0x10000, 0);
 
-        // if is negative
-        if (rel & 0x80)
+        if (mode == All)
         {
-            rel |= 0xFF00;
+            for (const Pair& pair : PAIRS)
+            {
+                Enable(pair);
+            }
         }
+    }
 
-        return rel + PC;
+    void Enable(const Pair& pair)
+    {
+        lengths[pair.first] = pair.length;
+        enabled[(pair.first << 8 | pair.second) >> 6] |= 1ull << (pair.second & 63);
     }
 
-    // Make set flags function for auto setting flags based on value?
-    // TODO: Make helper functions for instructions (push to stack, have IRQ and Reset vectors stored somewhere)
-    // INSTRUCTIONS
-    void NOP()
+    bool Enabled(const Byte first, const Byte second) const
     {
-        Clock(1);
+        return enabled[(first << 8 | second) >> 6] >> (second & 63) & 1;
     }
 
-    void BIT(const Byte b)
+    void Count(const Byte opcode)
     {
-        N = b & 0x80;
-        V = b & 0x40;
-        Z = A & b == 0;
+        counts[last << 8 | opcode]++;
+        last = opcode;
+        if (++counted == PROFILE_INSTRUCTIONS && mode == Auto)
+        {
+            Choose();
+            counting = keepCounting;
+        }
     }
 
-    // Transfers
-    void LDA(const Byte b)
+    void Choose()
     {
-        A = b;
+        std::string chosen;
+        for (const Pair& pair : PAIRS)
+        {
+            if (counts[pair.first << 8 | pair.second] >= THRESHOLD * counted)
+            {
+                Enable(pair);
+                chosen += chosen.empty() ? pair.name : std::string(", ") + pair.name;
+            }
+        }
+        // stderr, so it doesn't land in the middle of the machine's own output (--headless dumps, the terminal screen)
+        if (!chosen.empty()) std::cerr << "Fusing " << chosen << std::endl;
+    }
 
-        Z = A == 0;
-        N = A & 0x80;
+    static const char* Name(const int pair)
+    {
+        for (const Pair& p : PAIRS)
+        {
+            if ((p.first << 8 | p.second) == pair) return p.name;
+        }
+        return nullptr;
     }
 
-    void LDX(const Byte b)
+    // The most common pairs, one a line: opcodes, count, share of all instructions and the fusion's name if there is one
+    bool WriteProfile(const std::string& path, const int top = 64) const
     {
-        X = b;
+        std::ofstream f(path);
+        if (!f.is_open() || counts.empty()) return false;
 
-        Z = X == 0;
-        N = X & 0x80;
+        std::vector<int> pairs(0x10000);
+        for (int i = 0; i < 0x10000; i++)
+        {
+            pairs[i] = i;
+        }
+        std::sort(pairs.begin(), pairs.end(), [this](const int a, const int b) { return counts[a] > counts[b]; });
+
+        for (int i = 0; i < top && counts[pairs[i]] != 0; i++)
+        {
+            const int pair = pairs[i];
+            char line[96];
+            snprintf(line, sizeof(line), "%02X %02X %12llu %6.2f%%", pair >> 8, pair & 0xFF,
+                static_cast<unsigned long long>(counts[pair]), 100.0 * counts[pair] / counted);
+            f << line;
+            if (const char* name = Name(pair)) f << "  " << name << (Enabled(pair >> 8, pair & 0xFF) ? " (fused)" : "");
+            f << "\n";
+        }
+        return true;
     }
+};
 
-    void LDY(const Byte b)
-    {
-        Y = b;
+struct CPU6502
+{
+    bool debug = false; // Determines whether debug text will be printed to the screen
 
-        Z = Y == 0;
-        N = Y & 0x80;
+    Bus* bus;
+
+    Cycles numCycles = 0;
+    Scheduler scheduler;
+
+    // Plain counters for Telemetry, only ever touched by the CPU thread
+    uint64_t instructions = 0;
+    uint64_t irqs = 0;
+    uint64_t nmis = 0;
+    uint64_t pacingNs = 0;
+
+#ifdef HEATMAP
+    Heatmap heatmap;
+#endif
+
+    // Edge and executed address coverage when set
+    Coverage* coverage = nullptr;
+
+    // Where host input goes through, logged or replayed when set
+    InputLog* inputLog = nullptr;
+
+    // Instruction trace when set, annotated with symbols and source lines if there's debug info
+    std::ostream* trace = nullptr;
+    const DebugInfo* debugInfo = nullptr;
+
+    // Interrupt request lines, a bit per device, held until the device releases them
+    Byte irqLines = 0;
+    // NMI is edge triggered, taken at the next instruction boundary
+    bool nmiPending = false;
+
+    // Set by the debugger: PCs to stop at (a bit each) and what to call when one is reached
+    const uint64_t* breakpoints = nullptr;
+    std::function<void()> onBreakpoint;
+    // Called instead of complaining when set
+    std::function<void()> onIllegalOpcode;
+
+    // Leaves Execute at the next instruction boundary
+    bool stop = false;
+
+    // Runs every instruction on the cycle-exact core, or just those in the marked pages
+    bool exact = false;
+    bool exactPages[256] = {};
+
+    // Superinstructions on the fast core, and where the current Execute stops (fused pairs don't run past it)
+    Fusion fusion;
+    Cycles fuseEnd = 0;
+
+    Word PC = 0xFFFC; // Program Counter
+    Byte SP = 0xFF; // Stack Pointer
+
+    // Registers
+    Byte A = 0; // Accumulator
+    Byte X = 0;
+    Byte Y = 0;
+
+    // Status Flags
+    bool N = false; // Negative
+    bool V = false; // Overflow
+    bool B = false; // Break
+    bool D = false; // Decimal
+    bool I = false; // Interrupt Disable
+    bool Z = false; // Zero
+    bool C = false; // Carry
+
+    explicit CPU6502(Bus* bus)
+    {
+        this->bus = bus;
     }
 
-    void STA(const Word addr)
+    void Clock(const uint c = 1)
     {
-        WriteByte(addr, A);
+        if (useClockTime && !turbo && !lockstep)
+        {
+            const auto start = std::chrono::steady_clock::now();
+            std::this_thread::sleep_for(std::chrono::nanoseconds(static_cast<int>(clockTime * 1000000.0f * c)));
+            pacingNs += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+        }
+        numCycles += c;
     }
 
-    void STX(const Word addr)
+    void Reset()
     {
-        WriteByte(addr, X);
+        // ADD CLOCK TIMINGS FOR RESET
+
+        // Set PC to position to read start vector
+        PC = 0xFFFC;
+        // Reset stack pointer to top of stack
+        SP = 0xFF;
+
+        C = N = V = Z = D = I = false;
+        A = X = Y = 0;
+
+        // Read start vector
+        PC = FetchWord();
     }
 
-    void STY(const Word addr)
+    // Converts stack pointer to absolute address
+    Word SPToAddress() const
     {
-        WriteByte(addr, Y);
+        return 0x100 + SP;
     }
 
-    void TAX()
+    // Every bus access goes through Read and Write, the exact core clocks each one as it happens
+    // (the fast core clocks the whole instruction at the end instead, see Step)
+    template <bool Exact>
+    Byte Read(const Word addr)
     {
-        X = A;
-        Z = X == 0;
-        N = X & 0x80;
-        Clock(1);
+        if (Exact) Clock(1);
+        const Byte b = bus->ReadByte(addr);
+#ifdef HEATMAP
+        heatmap.reads[addr]++;
+#endif
+        if (debug) std::cout << std::hex << std::setw(4) << addr << " READ " << std::setw(2) << +b << std::endl;
+        return b;
     }
 
-    void TAY()
+    template <bool Exact>
+    void Write(const Word addr, const Byte b)
     {
-        Y = A;
-        Z = Y == 0;
-        N = Y & 0x80;
-        Clock(1);
+        if (Exact) Clock(1);
+        bus->WriteByte(addr, b);
+#ifdef HEATMAP
+        heatmap.writes[addr]++;
+#endif
+        if (debug) std::cout << std::hex << std::setw(4) << addr << " WRITE " << std::setw(2) << +b << std::endl;
     }
 
-    void TSX()
+    // Accesses the real chip makes and throws away, only the exact core bothers (they matter to devices with side effects)
+    template <bool Exact>
+    void DummyRead(const Word addr)
     {
-        X = SP;
-        Z = X == 0;
-        N = X & 0x80;
-        Clock(1);
+        if (Exact) Read<true>(addr);
     }
 
-    void TXA()
+    template <bool Exact>
+    void DummyWrite(const Word addr, const Byte b)
     {
-        A = X;
-        Z = A == 0;
-        N = A & 0x80;
-        Clock(1);
+        if (Exact) Write<true>(addr, b);
     }
 
-    void TXS()
+    // Fetches next byte at the PC and increments the PC
+    template <bool Exact = true>
+    Byte FetchByte()
     {
-        SP = X;
-        Clock(1);
+        return Read<Exact>(PC++);
     }
 
-    void TYA()
+    // Fetches next word at the PC in little endian
+    template <bool Exact = true>
+    Word FetchWord()
     {
-        A = Y;
-        Z = A == 0;
-        N = A & 0x80;
-        Clock(1);
+        Word w = FetchByte<Exact>();
+        w |= FetchByte<Exact>() << 8;
+        return w;
     }
 
-    // Stack
-    void PHA()
+    template <bool Exact>
+    void Push(const Byte b)
     {
-        WriteByte(SPToAddress(), A);
+        Write<Exact>(SPToAddress(), b);
         SP--;
-        Clock(1);
     }
 
-    void PLA()
+    template <bool Exact>
+    Byte Pull()
     {
         SP++;
-        A = ReadByte(SPToAddress());
-        Clock(2);
-        Z = A == 0;
-        N = A & 0x80;
+        return Read<Exact>(SPToAddress());
     }
 
-    void PHP()
+    // Status register as pushed to the stack (bit 5 is always set)
+    Byte Status() const
     {
-        B = true;
-        WriteByte(SPToAddress(), N << 7 + V << 6 + 1 << 5 + B << 4 + D << 3 + I << 2 + Z << 1 + C << 0);
-        SP--;
-        Clock(1);
-        B = false;
+        return N << 7 | V << 6 | 1 << 5 | B << 4 | D << 3 | I << 2 | Z << 1 | C;
     }
 
-    void PLP()
+    void SetStatus(const Byte status)
     {
-        SP++;
-        const Byte status = ReadByte(SPToAddress());
         C = status & 0b00000001;
         Z = status & 0b00000010;
         I = status & 0b00000100;
@@ -986,611 +1464,6307 @@ struct CPU6502
         B = status & 0b00010000;
         V = status & 0b01000000;
         N = status & 0b10000000;
-        Clock(2);
     }
 
-    // Increments
-    void INC(const Word addr)
+    void SetIRQ(const Byte line, const bool active)
     {
-        const Byte b = ReadByte(addr);
-        WriteByte(addr, b + 1);
-        Clock(1);
-
-        Z = (b + 1 & 0xFF) == 0;
-        N = b + 1 & 0xFF & 0x80;
+        const Byte lines = active ? irqLines | line : irqLines & ~line;
+        if (lines != irqLines && inputLog != nullptr) inputLog->Check(InputLog::Irq, numCycles, lines);
+        irqLines = lines;
     }
 
-    void INX()
+    // Cycle count, PC and registers before the instruction runs, then where it is
+    void Trace()
     {
-        X++;
-        Clock(1);
-
-        Z = X == 0;
-        N = X & 0x80;
+        char line[64];
+        snprintf(line, sizeof(line), "%10llu %04X  A=%02X X=%02X Y=%02X SP=%02X P=%02X", numCycles, PC, A, X, Y, SP, Status());
+        *trace << line;
+        if (debugInfo != nullptr)
+        {
+            *trace << "  " << debugInfo->Symbolize(PC);
+            const std::string source = debugInfo->Source(PC);
+            if (!source.empty()) *trace << "  " << source;
+        }
+        *trace << "\n";
     }
 
-    void INY()
+    // Called wherever control flow can go more than one way, with where it went
+    void Edge(const Word target)
     {
-        Y++;
-        Clock(1);
-
-        Z = Y == 0;
-        N = Y & 0x80;
+        if (coverage != nullptr) coverage->Edge(target);
     }
 
-    // Decrements
-    void DEC(const Word addr)
+    // Pushes PC and status (with B clear) and jumps through vector, 7 cycles
+    template <bool Exact>
+    void Interrupt(const Word vector)
     {
-        const Byte b = ReadByte(addr);
-        WriteByte(addr, b - 1);
-        Clock(1);
+        if (vector == 0xFFFA) nmis++;
+        else irqs++;
 
-        Z = (b - 1 & 0xFF) == 0;
-        N = b - 1 & 0xFF & 0x80;
+        // The chip reads the next opcode twice and throws it away
+        DummyRead<Exact>(PC);
+        DummyRead<Exact>(PC);
+        Push<Exact>(PC >> 8);
+        Push<Exact>(PC & 0xFF);
+        Push<Exact>(Status() & ~0b00010000);
+
+        I = true;
+
+        PC = Read<Exact>(vector);
+        PC |= Read<Exact>(vector + 1) << 8;
+        if (!Exact) Clock(7);
+        Edge(PC);
     }
 
-    void DEX()
+    // Which core runs the instruction at the PC
+    bool UseExact() const
     {
-        X--;
-        Clock(1);
-
-        Z = X == 0;
-        N = X & 0x80;
+        return exact || exactPages[PC >> 8];
     }
 
-    void DEY()
+    void IRQ()
     {
-        Y--;
-        Clock(1);
+        if (I == false)
+        {
+            // Read IRQ interrupt vector
+            if (UseExact()) Interrupt<true>(0xFFFE);
+            else Interrupt<false>(0xFFFE);
+        }
+    }
 
-        Z = Y == 0;
-        N = Y & 0x80;
+    void NMI()
+    {
+        // Read NMI interrupt vector
+        if (UseExact()) Interrupt<true>(0xFFFA);
+        else Interrupt<false>(0xFFFA);
     }
 
-    // Logic
-    void AND(const Byte b)
+    // Executes the number of cycles provided
+    void Execute(const Cycles cycles)
     {
-        A &= b;
+        const Cycles startCycles = numCycles;
+        Cycles deltaCycles = 0;
+        fuseEnd = cycles > Scheduler::NEVER - startCycles ? Scheduler::NEVER : startCycles + cycles;
+        while (deltaCycles < cycles && running && !stop)
+        {
+            if (numCycles >= scheduler.next)
+            {
+                while (numCycles >= scheduler.next)
+                {
+                    scheduler.Run(numCycles);
+                }
+                // An event can end the run before the next instruction
+                if (!running || stop) break;
+            }
 
-        Z = A == 0;
-        N = A & 0x80;
+            if (nmiPending)
+            {
+                nmiPending = false;
+                if (inputLog != nullptr) inputLog->Check(InputLog::Nmi, numCycles, PC);
+                NMI();
+            }
+            else if (irqLines != 0 && !I)
+            {
+                IRQ();
+            }
+
+            if (breakpoints != nullptr && breakpoints[PC >> 6] >> (PC & 63) & 1)
+            {
+                onBreakpoint();
+                if (stop) break;
+            }
+
+#ifdef HEATMAP
+            heatmap.executes[PC]++;
+#endif
+            if (coverage != nullptr) coverage->Executed(PC);
+            instructions++;
+            if (trace != nullptr) Trace();
+            if (fusion.counting) fusion.Count(bus->Peek(PC));
+
+            // The core can change between any two instructions
+            if (UseExact()) Step<true>();
+            else if (!StepFused()) Step<false>();
+
+            // std::cout << std::hex << std::setw(2) << +bus->ram.data[0x0001] << +bus->ram.data[0x0000] << std::endl;
+            deltaCycles = numCycles - startCycles;
+        }
     }
 
-    void ORA(const Byte b)
+    // Cycles for each opcode on the fast core, before page crossings and taken branches
+    static constexpr Byte CYCLES[256] = {
+        7, 6, 2, 8, 3, 3, 5, 5, 3, 2, 2, 2, 4, 4, 6, 6,
+        2, 5, 2, 8, 4, 4, 6, 6, 2, 4, 2, 7, 4, 4, 7, 7,
+        6, 6, 2, 8, 3, 3, 5, 5, 4, 2, 2, 2, 4, 4, 6, 6,
+        2, 5, 2, 8, 4, 4, 6, 6, 2, 4, 2, 7, 4, 4, 7, 7,
+        6, 6, 2, 8, 3, 3, 5, 5, 3, 2, 2, 2, 3, 4, 6, 6,
+        2, 5, 2, 8, 4, 4, 6, 6, 2, 4, 2, 7, 4, 4, 7, 7,
+        6, 6, 2, 8, 3, 3, 5, 5, 4, 2, 2, 2, 5, 4, 6, 6,
+        2, 5, 2, 8, 4, 4, 6, 6, 2, 4, 2, 7, 4, 4, 7, 7,
+        2, 6, 2, 6, 3, 3, 3, 3, 2, 2, 2, 2, 4, 4, 4, 4,
+        2, 6, 2, 6, 4, 4, 4, 4, 2, 5, 2, 5, 5, 5, 5, 5,
+        2, 6, 2, 6, 3, 3, 3, 3, 2, 2, 2, 2, 4, 4, 4, 4,
+        2, 5, 2, 5, 4, 4, 4, 4, 2, 4, 2, 4, 4, 4, 4, 4,
+        2, 6, 2, 8, 3, 3, 5, 5, 2, 2, 2, 2, 4, 4, 6, 6,
+        2, 5, 2, 8, 4, 4, 6, 6, 2, 4, 2, 7, 4, 4, 7, 7,
+        2, 6, 2, 8, 3, 3, 5, 5, 2, 2, 2, 2, 4, 4, 6, 6,
+        2, 5, 2, 8, 4, 4, 6, 6, 2, 4, 2, 7, 4, 4, 7, 7,
+    };
+
+    // Page crossings and taken branches on the fast core, added to CYCLES at the end of the instruction
+    uint extraCycles = 0;
+
+    // Runs one instruction, on one of two cores built from the same code:
+    // Exact makes every bus access the real chip makes, in order and a cycle each (dummy reads and writes included)
+    // Fast only makes the accesses that change something and clocks the instruction's total from CYCLES at the end
+    template <bool Exact>
+    void Step()
     {
-        A |= b;
+        extraCycles = 0;
 
-        Z = A == 0;
-        N = A & 0x80;
+        const Byte opcode = FetchByte<Exact>();
+        switch (opcode)
+        {
+            // No addressing mode function call = implied (Implied() is the throwaway read of the next byte)
+            // "Read<Exact>(Absolute<Exact>())" means the instruction uses the byte at the supplied address (e.g. ADC, LDA)
+            // "Absolute<Exact>()" means the instruction uses the address itself (e.g. STA, JMP)
+            // Modify is a read-modify-write of memory, accumulator versions just take and return A
+            case 0xEA:
+                Implied<Exact>();
+                NOP();
+                break;
+
+            case 0x2C:
+                BIT(Read<Exact>(Absolute<Exact>()));
+                break;
+            case 0x24:
+                BIT(Read<Exact>(ZeroPage<Exact>()));
+                break;
+
+            case 0xA9:
+                LDA(Immediate<Exact>());
+                break;
+            case 0xAD:
+                LDA(Read<Exact>(Absolute<Exact>()));
+                break;
+            case 0xA5:
+                LDA(Read<Exact>(ZeroPage<Exact>()));
+                break;
+            case 0xB5:
+                LDA(Read<Exact>(ZeroPageX<Exact>()));
+                break;
+            case 0xBD:
+                LDA(Read<Exact>(AbsoluteX<Exact>()));
+                break;
+            case 0xB9:
+                LDA(Read<Exact>(AbsoluteY<Exact>()));
+                break;
+            case 0xA1:
+                LDA(Read<Exact>(IndirectX<Exact>()));
+                break;
+            case 0xB1:
+                LDA(Read<Exact>(IndirectY<Exact>()));
+                break;
+
+            case 0xA2:
+                LDX(Immediate<Exact>());
+                break;
+            case 0xAE:
+                LDX(Read<Exact>(Absolute<Exact>()));
+                break;
+            case 0xA6:
+                LDX(Read<Exact>(ZeroPage<Exact>()));
+                break;
+            case 0xB6:
+                LDX(Read<Exact>(ZeroPageY<Exact>()));
+                break;
+            case 0xBE:
+                LDX(Read<Exact>(AbsoluteY<Exact>()));
+                break;
+
+            case 0xA0:
+                LDY(Immediate<Exact>());
+                break;
+            case 0xAC:
+                LDY(Read<Exact>(Absolute<Exact>()));
+                break;
+            case 0xA4:
+                LDY(Read<Exact>(ZeroPage<Exact>()));
+                break;
+            case 0xB4:
+                LDY(Read<Exact>(ZeroPageX<Exact>()));
+                break;
+            case 0xBC:
+                LDY(Read<Exact>(AbsoluteX<Exact>()));
+                break;
+
+            case 0x8D:
+                STA<Exact>(Absolute<Exact>());
+                break;
+            case 0x85:
+                STA<Exact>(ZeroPage<Exact>());
+                break;
+            case 0x95:
+                STA<Exact>(ZeroPageX<Exact>());
+                break;
+            case 0x9D:
+                STA<Exact>(AbsoluteX<Exact>(true));
+                break;
+            case 0x99:
+                STA<Exact>(AbsoluteY<Exact>(true));
+                break;
+            case 0x81:
+                STA<Exact>(IndirectX<Exact>());
+                break;
+            case 0x91:
+                STA<Exact>(IndirectY<Exact>(true));
+                break;
+
+            case 0x8E:
+                STX<Exact>(Absolute<Exact>());
+                break;
+            case 0x86:
+                STX<Exact>(ZeroPage<Exact>());
+                break;
+            case 0x96:
+                STX<Exact>(ZeroPageY<Exact>());
+                break;
+
+            case 0x8C:
+                STY<Exact>(Absolute<Exact>());
+                break;
+            case 0x84:
+                STY<Exact>(ZeroPage<Exact>());
+                break;
+            case 0x94:
+                STY<Exact>(ZeroPageX<Exact>());
+                break;
+
+            case 0xAA:
+                Implied<Exact>();
+                TAX();
+                break;
+
+            case 0xA8:
+                Implied<Exact>();
+                TAY();
+                break;
+
+            case 0xBA:
+                Implied<Exact>();
+                TSX();
+                break;
+
+            case 0x8A:
+                Implied<Exact>();
+                TXA();
+                break;
+
+            case 0x9A:
+                Implied<Exact>();
+                TXS();
+                break;
+
+            case 0x98:
+                Implied<Exact>();
+                TYA();
+                break;
+
+            case 0x48:
+                PHA<Exact>();
+                break;
+
+            case 0x68:
+                PLA<Exact>();
+                break;
+
+            case 0x08:
+                PHP<Exact>();
+                break;
+
+            case 0x28:
+                PLP<Exact>();
+                break;
+
+            case 0xEE:
+                Modify<Exact, &CPU6502::INC>(Absolute<Exact>());
+                break;
+            case 0xE6:
+                Modify<Exact, &CPU6502::INC>(ZeroPage<Exact>());
+                break;
+            case 0xF6:
+                Modify<Exact, &CPU6502::INC>(ZeroPageX<Exact>());
+                break;
+            case 0xFE:
+                Modify<Exact, &CPU6502::INC>(AbsoluteX<Exact>(true));
+                break;
+
+            case 0xE8:
+                Implied<Exact>();
+                INX();
+                break;
+
+            case 0xC8:
+                Implied<Exact>();
+                INY();
+                break;
+
+            case 0xCE:
+                Modify<Exact, &CPU6502::DEC>(Absolute<Exact>());
+                break;
+            case 0xC6:
+                Modify<Exact, &CPU6502::DEC>(ZeroPage<Exact>());
+                break;
+            case 0xD6:
+                Modify<Exact, &CPU6502::DEC>(ZeroPageX<Exact>());
+                break;
+            case 0xDE:
+                Modify<Exact, &CPU6502::DEC>(AbsoluteX<Exact>(true));
+                break;
+
+            case 0xCA:
+                Implied<Exact>();
+                DEX();
+                break;
+
+            case 0x88:
+                Implied<Exact>();
+                DEY();
+                break;
+
+            case 0x29:
+                AND(Immediate<Exact>());
+                break;
+            case 0x2D:
+                AND(Read<Exact>(Absolute<Exact>()));
+                break;
+            case 0x25:
+                AND(Read<Exact>(ZeroPage<Exact>()));
+                break;
+            case 0x35:
+                AND(Read<Exact>(ZeroPageX<Exact>()));
+                break;
+            case 0x3D:
+                AND(Read<Exact>(AbsoluteX<Exact>()));
+                break;
+            case 0x39:
+                AND(Read<Exact>(AbsoluteY<Exact>()));
+                break;
+            case 0x21:
+                AND(Read<Exact>(IndirectX<Exact>()));
+                break;
+            case 0x31:
+                AND(Read<Exact>(IndirectY<Exact>()));
+                break;
+
+            case 0x09:
+                ORA(Immediate<Exact>());
+                break;
+            case 0x0D:
+                ORA(Read<Exact>(Absolute<Exact>()));
+                break;
+            case 0x05:
+                ORA(Read<Exact>(ZeroPage<Exact>()));
+                break;
+            case 0x15:
+                ORA(Read<Exact>(ZeroPageX<Exact>()));
+                break;
+            case 0x1D:
+                ORA(Read<Exact>(AbsoluteX<Exact>()));
+                break;
+            case 0x19:
+                ORA(Read<Exact>(AbsoluteY<Exact>()));
+                break;
+            case 0x01:
+                ORA(Read<Exact>(IndirectX<Exact>()));
+                break;
+            case 0x11:
+                ORA(Read<Exact>(IndirectY<Exact>()));
+                break;
+
+            case 0x49:
+                EOR(Immediate<Exact>());
+                break;
+            case 0x4D:
+                EOR(Read<Exact>(Absolute<Exact>()));
+                break;
+            case 0x45:
+                EOR(Read<Exact>(ZeroPage<Exact>()));
+                break;
+            case 0x55:
+                EOR(Read<Exact>(ZeroPageX<Exact>()));
+                break;
+            case 0x5D:
+                EOR(Read<Exact>(AbsoluteX<Exact>()));
+                break;
+            case 0x59:
+                EOR(Read<Exact>(AbsoluteY<Exact>()));
+                break;
+            case 0x41:
+                EOR(Read<Exact>(IndirectX<Exact>()));
+                break;
+            case 0x51:
+                EOR(Read<Exact>(IndirectY<Exact>()));
+                break;
+
+            case 0xC9:
+                CMP(Immediate<Exact>());
+                break;
+            case 0xCD:
+                CMP(Read<Exact>(Absolute<Exact>()));
+                break;
+            case 0xC5:
+                CMP(Read<Exact>(ZeroPage<Exact>()));
+                break;
+            case 0xD5:
+                CMP(Read<Exact>(ZeroPageX<Exact>()));
+                break;
+            case 0xDD:
+                CMP(Read<Exact>(AbsoluteX<Exact>()));
+                break;
+            case 0xD9:
+                CMP(Read<Exact>(AbsoluteY<Exact>()));
+                break;
+            case 0xC1:
+                CMP(Read<Exact>(IndirectX<Exact>()));
+                break;
+            case 0xD1:
+                CMP(Read<Exact>(IndirectY<Exact>()));
+                break;
+
+            case 0xE0:
+                CPX(Immediate<Exact>());
+                break;
+            case 0xEC:
+                CPX(Read<Exact>(Absolute<Exact>()));
+                break;
+            case 0xE4:
+                CPX(Read<Exact>(ZeroPage<Exact>()));
+                break;
+
+            case 0xC0:
+                CPY(Immediate<Exact>());
+                break;
+            case 0xCC:
+                CPY(Read<Exact>(Absolute<Exact>()));
+                break;
+            case 0xC4:
+                CPY(Read<Exact>(ZeroPage<Exact>()));
+                break;
+
+            case 0x0A:
+                Implied<Exact>();
+                A = ASL(A);
+                break;
+            case 0x0E:
+                Modify<Exact, &CPU6502::ASL>(Absolute<Exact>());
+                break;
+            case 0x06:
+                Modify<Exact, &CPU6502::ASL>(ZeroPage<Exact>());
+                break;
+            case 0x16:
+                Modify<Exact, &CPU6502::ASL>(ZeroPageX<Exact>());
+                break;
+            case 0x1E:
+                Modify<Exact, &CPU6502::ASL>(AbsoluteX<Exact>(true));
+                break;
+
+            case 0x4A:
+                Implied<Exact>();
+                A = LSR(A);
+                break;
+            case 0x4E:
+                Modify<Exact, &CPU6502::LSR>(Absolute<Exact>());
+                break;
+            case 0x46:
+                Modify<Exact, &CPU6502::LSR>(ZeroPage<Exact>());
+                break;
+            case 0x56:
+                Modify<Exact, &CPU6502::LSR>(ZeroPageX<Exact>());
+                break;
+            case 0x5E:
+                Modify<Exact, &CPU6502::LSR>(AbsoluteX<Exact>(true));
+                break;
+
+            case 0x2A:
+                Implied<Exact>();
+                A = ROL(A);
+                break;
+            case 0x2E:
+                Modify<Exact, &CPU6502::ROL>(Absolute<Exact>());
+                break;
+            case 0x26:
+                Modify<Exact, &CPU6502::ROL>(ZeroPage<Exact>());
+                break;
+            case 0x36:
+                Modify<Exact, &CPU6502::ROL>(ZeroPageX<Exact>());
+                break;
+            case 0x3E:
+                Modify<Exact, &CPU6502::ROL>(AbsoluteX<Exact>(true));
+                break;
+
+            case 0x6A:
+                Implied<Exact>();
+                A = ROR(A);
+                break;
+            case 0x6E:
+                Modify<Exact, &CPU6502::ROR>(Absolute<Exact>());
+                break;
+            case 0x66:
+                Modify<Exact, &CPU6502::ROR>(ZeroPage<Exact>());
+                break;
+            case 0x76:
+                Modify<Exact, &CPU6502::ROR>(ZeroPageX<Exact>());
+                break;
+            case 0x7E:
+                Modify<Exact, &CPU6502::ROR>(AbsoluteX<Exact>(true));
+                break;
+
+            case 0x4C:
+                JMP(Absolute<Exact>());
+                break;
+            case 0x6C:
+                JMP(Indirect<Exact>());
+                break;
+
+            case 0x20:
+                JSR<Exact>();
+                break;
+
+            case 0x60:
+                RTS<Exact>();
+                break;
+
+            case 0xF0: // BEQ
+                Branch<Exact>(Z);
+                break;
+
+            case 0xD0: // BNE
+                Branch<Exact>(!Z);
+                break;
+
+            case 0xB0: // BCS
+                Branch<Exact>(C);
+                break;
+
+            case 0x90: // BCC
+                Branch<Exact>(!C);
+                break;
+
+            case 0x10: // BPL
+                Branch<Exact>(!N);
+                break;
+
+            case 0x30: // BMI
+                Branch<Exact>(N);
+                break;
+
+            case 0x50: // BVC
+                Branch<Exact>(!V);
+                break;
+
+            case 0x70: // BVS
+                Branch<Exact>(V);
+                break;
+
+            case 0x00:
+                BRK<Exact>();
+                break;
+
+            case 0x40:
+                RTI<Exact>();
+                break;
+
+            case 0x18:
+                Implied<Exact>();
+                CLC();
+                break;
+
+            case 0x38:
+                Implied<Exact>();
+                SEC();
+                break;
+
+            case 0xD8:
+                Implied<Exact>();
+                CLD();
+                break;
+
+            case 0xF8:
+                Implied<Exact>();
+                SED();
+                break;
+
+            case 0x58:
+                Implied<Exact>();
+                CLI();
+                break;
+
+            case 0x78:
+                Implied<Exact>();
+                SEI();
+                break;
+
+            case 0xB8:
+                Implied<Exact>();
+                CLV();
+                break;
+
+            case 0x69:
+                ADC(Immediate<Exact>());
+                break;
+            case 0x6D:
+                ADC(Read<Exact>(Absolute<Exact>()));
+                break;
+            case 0x65:
+                ADC(Read<Exact>(ZeroPage<Exact>()));
+                break;
+            case 0x75:
+                ADC(Read<Exact>(ZeroPageX<Exact>()));
+                break;
+            case 0x7D:
+                ADC(Read<Exact>(AbsoluteX<Exact>()));
+                break;
+            case 0x79:
+                ADC(Read<Exact>(AbsoluteY<Exact>()));
+                break;
+            case 0x61:
+                ADC(Read<Exact>(IndirectX<Exact>()));
+                break;
+            case 0x71:
+                ADC(Read<Exact>(IndirectY<Exact>()));
+                break;
+
+            case 0xE9:
+                SBC(Immediate<Exact>());
+                break;
+            case 0xED:
+                SBC(Read<Exact>(Absolute<Exact>()));
+                break;
+            case 0xE5:
+                SBC(Read<Exact>(ZeroPage<Exact>()));
+                break;
+            case 0xF5:
+                SBC(Read<Exact>(ZeroPageX<Exact>()));
+                break;
+            case 0xFD:
+                SBC(Read<Exact>(AbsoluteX<Exact>()));
+                break;
+            case 0xF9:
+                SBC(Read<Exact>(AbsoluteY<Exact>()));
+                break;
+            case 0xE1:
+                SBC(Read<Exact>(IndirectX<Exact>()));
+                break;
+            case 0xF1:
+                SBC(Read<Exact>(IndirectY<Exact>()));
+                break;
+
+            default:
+                // Takes CYCLES[opcode] on both cores: the exact core reads the next byte for the rest of them
+                for (int i = 1; i < CYCLES[opcode]; i++) DummyRead<Exact>(PC);
+                if (onIllegalOpcode) onIllegalOpcode();
+                else std::cout << "Instruction not recognized" << std::endl;
+        }
+
+        if (!Exact) Clock(CYCLES[opcode] + extraCycles);
     }
 
-    void EOR(const Byte b)
+    // Fast core only: runs the instruction at the PC and the one after it as a superinstruction if they're an enabled
+    // pair, otherwise does nothing and returns false. Each half clocks its own cycles from CYCLES like Step does
+    bool StepFused()
     {
-        A ^= b;
+        // Looks ahead without side effects, so only in plain memory
+        const Byte* page = bus->readPages[PC >> 8];
+        if (page == nullptr) return false;
+        const Byte first = page[PC & 0xFF];
+        if (fusion.lengths[first] == 0) return false;
+        const Word next = PC + fusion.lengths[first];
+        const Byte* nextPage = bus->readPages[next >> 8];
+        if (nextPage == nullptr || !fusion.Enabled(first, nextPage[next & 0xFF])) return false;
+        const Byte second = nextPage[next & 0xFF];
+
+        extraCycles = 0;
+        FetchByte<false>();
+        switch (first << 8 | second)
+        {
+            case 0xCAD0:
+                DEX();
+                if (!Fuse(first)) return true;
+                Branch<false>(!Z);
+                break;
+            case 0x88D0:
+                DEY();
+                if (!Fuse(first)) return true;
+                Branch<false>(!Z);
+                break;
+            case 0xE8D0:
+                INX();
+                if (!Fuse(first)) return true;
+                Branch<false>(!Z);
+                break;
+            case 0xC8D0:
+                INY();
+                if (!Fuse(first)) return true;
+                Branch<false>(!Z);
+                break;
+
+            case 0xA985:
+                LDA(Immediate<false>());
+                if (!Fuse(first)) return true;
+                STA<false>(ZeroPage<false>());
+                break;
+            case 0xA98D:
+                LDA(Immediate<false>());
+                if (!Fuse(first)) return true;
+                STA<false>(Absolute<false>());
+                break;
+            case 0xA585:
+                LDA(Read<false>(ZeroPage<false>()));
+                if (!Fuse(first)) return true;
+                STA<false>(ZeroPage<false>());
+                break;
+            case 0xA58D:
+                LDA(Read<false>(ZeroPage<false>()));
+                if (!Fuse(first)) return true;
+                STA<false>(Absolute<false>());
+                break;
+            case 0xAD85:
+                LDA(Read<false>(Absolute<false>()));
+                if (!Fuse(first)) return true;
+                STA<false>(ZeroPage<false>());
+                break;
+            case 0xAD8D:
+                LDA(Read<false>(Absolute<false>()));
+                if (!Fuse(first)) return true;
+                STA<false>(Absolute<false>());
+                break;
+
+            case 0xC9F0:
+                CMP(Immediate<false>());
+                if (!Fuse(first)) return true;
+                Branch<false>(Z);
+                break;
+            case 0xC9D0:
+                CMP(Immediate<false>());
+                if (!Fuse(first)) return true;
+                Branch<false>(!Z);
+                break;
+            case 0xE0F0:
+                CPX(Immediate<false>());
+                if (!Fuse(first)) return true;
+                Branch<false>(Z);
+                break;
+            case 0xE0D0:
+                CPX(Immediate<false>());
+                if (!Fuse(first)) return true;
+                Branch<false>(!Z);
+                break;
+            case 0xC0F0:
+                CPY(Immediate<false>());
+                if (!Fuse(first)) return true;
+                Branch<false>(Z);
+                break;
+            case 0xC0D0:
+                CPY(Immediate<false>());
+                if (!Fuse(first)) return true;
+                Branch<false>(!Z);
+                break;
+
+            case 0xB191:
+                LDA(Read<false>(IndirectY<false>()));
+                if (!Fuse(first)) return true;
+                STA<false>(IndirectY<false>(true));
+                break;
+            case 0xB199:
+                LDA(Read<false>(IndirectY<false>()));
+                if (!Fuse(first)) return true;
+                STA<false>(AbsoluteY<false>(true));
+                break;
+            case 0xB999:
+                LDA(Read<false>(AbsoluteY<false>()));
+                if (!Fuse(first)) return true;
+                STA<false>(AbsoluteY<false>(true));
+                break;
+            case 0xBD9D:
+                LDA(Read<false>(AbsoluteX<false>()));
+                if (!Fuse(first)) return true;
+                STA<false>(AbsoluteX<false>(true));
+                break;
+
+            default:
+                // Every pair in Fusion::PAIRS has a case, but just in case Step runs it instead
+                PC--;
+                return false;
+        }
 
-        Z = A == 0;
-        Z = A & 0x80;
+        Clock(CYCLES[second] + extraCycles);
+        return true;
     }
 
-    // Comparisons
-    void CMP(const Byte b)
+    // Ends the first half of a fused pair. The second half only goes on if nothing would have happened at the boundary
+    // between them in Execute's loop (an event, an interrupt, the end of the run, a breakpoint or trace), otherwise it's
+    // left for the loop to run as a normal instruction so everything still lands on the same boundaries
+    bool Fuse(const Byte first)
     {
-        const Byte diff = static_cast<Word>(A) - static_cast<Word>(b) & 0xFF;
+        Clock(CYCLES[first] + extraCycles);
+        extraCycles = 0;
+
+        if (numCycles >= scheduler.next || numCycles >= fuseEnd || !running || stop) return false;
+        if (nmiPending || (irqLines != 0 && !I)) return false;
+        if (trace != nullptr || UseExact()) return false;
+        if (breakpoints != nullptr && breakpoints[PC >> 6] >> (PC & 63) & 1) return false;
+
+#ifdef HEATMAP
+        heatmap.executes[PC]++;
+#endif
+        if (coverage != nullptr) coverage->Executed(PC);
+        instructions++;
+
+        const Byte second = FetchByte<false>();
+        if (fusion.counting) fusion.Count(second);
+        return true;
+    }
 
-        N = diff & 0x80;
-        C = A >= b;
-        Z = A == b;
+    // Addressing mode helpers (Accumulator instructions just use A)
+    // Indexed modes take whether the instruction writes: reads skip the fix-up cycle when the index doesn't cross a page
+    template <bool Exact>
+    void Implied()
+    {
+        DummyRead<Exact>(PC);
     }
 
-    void CPX(const Byte b)
+    template <bool Exact>
+    Byte Immediate()
     {
-        const Byte diff = static_cast<Word>(X) - static_cast<Word>(b) & 0xFF;
+        return FetchByte<Exact>();
+    }
 
-        N = diff & 0x80;
-        C = X >= b;
-        Z = X == b;
+    template <bool Exact>
+    Word Absolute()
+    {
+        return FetchWord<Exact>();
     }
 
-    void CPY(const Byte b)
+    // The chip adds the index to the low byte first and reads from there while it fixes up the high byte
+    template <bool Exact>
+    Word Indexed(const Word base, const Byte index, const bool write)
     {
-        const Byte diff = static_cast<Word>(Y) - static_cast<Word>(b) & 0xFF;
+        const Word addr = base + index;
+        const bool crossed = (base ^ addr) & 0xFF00;
+        if (write || crossed)
+        {
+            DummyRead<Exact>((base & 0xFF00) | (addr & 0x00FF));
+        }
+        if (!write && crossed)
+        {
+            extraCycles++;
+        }
+        return addr;
+    }
 
-        N = diff & 0x80;
-        C = Y >= b;
-        Z = Y == b;
+    template <bool Exact>
+    Word AbsoluteX(const bool write = false)
+    {
+        return Indexed<Exact>(FetchWord<Exact>(), X, write);
     }
 
-    // Shifts
-    void ASL(const Word addr, const bool acc)
+    template <bool Exact>
+    Word AbsoluteY(const bool write = false)
     {
-        if (acc)
-        {
-            C = A & 0x80;
+        return Indexed<Exact>(FetchWord<Exact>(), Y, write);
+    }
 
-            A <<= 1;
+    template <bool Exact>
+    Word ZeroPage()
+    {
+        return FetchByte<Exact>();
+    }
 
-            Z = A == 0;
-            N = A & 0x80;
-        }
-        else
-        {
-            Byte b = ReadByte(addr);
+    // Zero page indexing wraps around within the zero page
+    template <bool Exact>
+    Word ZeroPageX()
+    {
+        const Byte base = FetchByte<Exact>();
+        DummyRead<Exact>(base);
+        return static_cast<Byte>(base + X);
+    }
 
-            C = b & 0x80;
-            b <<= 1;
+    template <bool Exact>
+    Word ZeroPageY()
+    {
+        const Byte base = FetchByte<Exact>();
+        DummyRead<Exact>(base);
+        return static_cast<Byte>(base + Y);
+    }
 
-            Z = b == 0;
-            N = b & 0x80;
+    // JMP only, the high byte comes from the same page as the low byte (the NMOS bug with pointers at xxFF)
+    template <bool Exact>
+    Word Indirect()
+    {
+        const Word pointer = FetchWord<Exact>();
+        Word addr = Read<Exact>(pointer);
+        addr |= Read<Exact>((pointer & 0xFF00) | ((pointer + 1) & 0x00FF)) << 8;
+        return addr;
+    }
 
-            WriteByte(addr, b);
-        }
+    template <bool Exact>
+    Word IndirectX()
+    {
+        const Byte pointer = FetchByte<Exact>();
+        DummyRead<Exact>(pointer);
+        Word addr = Read<Exact>(static_cast<Byte>(pointer + X));
+        addr |= Read<Exact>(static_cast<Byte>(pointer + X + 1)) << 8;
+        return addr;
+    }
 
-        Clock(1);
+    template <bool Exact>
+    Word IndirectY(const bool write = false)
+    {
+        const Byte pointer = FetchByte<Exact>();
+        Word base = Read<Exact>(pointer);
+        base |= Read<Exact>(static_cast<Byte>(pointer + 1)) << 8;
+        return Indexed<Exact>(base, Y, write);
     }
 
-    void LSR(const Word addr, const bool acc)
+    // Read-modify-write: the chip writes the unmodified value back before the result
+    template <bool Exact, Byte (CPU6502::*Op)(Byte)>
+    void Modify(const Word addr)
     {
-        if (acc)
-        {
-            C = A & 0x01;
-            A >>= 1;
+        const Byte b = Read<Exact>(addr);
+        DummyWrite<Exact>(addr, b);
+        Write<Exact>(addr, (this->*Op)(b));
+    }
 
-            Z = A == 0;
-            N = A & 0x80;
+    // Make set flags function for auto setting flags based on value?
+    // INSTRUCTIONS
+    void NOP()
+    {
+    }
+
+    void BIT(const Byte b)
+    {
+        N = b & 0x80;
+        V = b & 0x40;
+        Z = (A & b) == 0;
+    }
+
+    // Transfers
+    void LDA(const Byte b)
+    {
+        A = b;
+
+        Z = A == 0;
+        N = A & 0x80;
+    }
+
+    void LDX(const Byte b)
+    {
+        X = b;
+
+        Z = X == 0;
+        N = X & 0x80;
+    }
+
+    void LDY(const Byte b)
+    {
+        Y = b;
+
+        Z = Y == 0;
+        N = Y & 0x80;
+    }
+
+    template <bool Exact>
+    void STA(const Word addr)
+    {
+        Write<Exact>(addr, A);
+    }
+
+    template <bool Exact>
+    void STX(const Word addr)
+    {
+        Write<Exact>(addr, X);
+    }
+
+    template <bool Exact>
+    void STY(const Word addr)
+    {
+        Write<Exact>(addr, Y);
+    }
+
+    void TAX()
+    {
+        X = A;
+        Z = X == 0;
+        N = X & 0x80;
+    }
+
+    void TAY()
+    {
+        Y = A;
+        Z = Y == 0;
+        N = Y & 0x80;
+    }
+
+    void TSX()
+    {
+        X = SP;
+        Z = X == 0;
+        N = X & 0x80;
+    }
+
+    void TXA()
+    {
+        A = X;
+        Z = A == 0;
+        N = A & 0x80;
+    }
+
+    void TXS()
+    {
+        SP = X;
+    }
+
+    void TYA()
+    {
+        A = Y;
+        Z = A == 0;
+        N = A & 0x80;
+    }
+
+    // Stack
+    template <bool Exact>
+    void PHA()
+    {
+        Implied<Exact>();
+        Push<Exact>(A);
+    }
+
+    // Pulls spend a cycle reading the stack before SP is incremented
+    template <bool Exact>
+    void PLA()
+    {
+        Implied<Exact>();
+        DummyRead<Exact>(SPToAddress());
+        A = Pull<Exact>();
+        Z = A == 0;
+        N = A & 0x80;
+    }
+
+    template <bool Exact>
+    void PHP()
+    {
+        Implied<Exact>();
+        // B is always set when pushed by PHP/BRK
+        Push<Exact>(Status() | 0b00010000);
+    }
+
+    template <bool Exact>
+    void PLP()
+    {
+        Implied<Exact>();
+        DummyRead<Exact>(SPToAddress());
+        SetStatus(Pull<Exact>());
+    }
+
+    // Increments
+    Byte INC(const Byte b)
+    {
+        const Byte result = b + 1;
+        Z = result == 0;
+        N = result & 0x80;
+        return result;
+    }
+
+    void INX()
+    {
+        X++;
+
+        Z = X == 0;
+        N = X & 0x80;
+    }
+
+    void INY()
+    {
+        Y++;
+
+        Z = Y == 0;
+        N = Y & 0x80;
+    }
+
+    // Decrements
+    Byte DEC(const Byte b)
+    {
+        const Byte result = b - 1;
+        Z = result == 0;
+        N = result & 0x80;
+        return result;
+    }
+
+    void DEX()
+    {
+        X--;
+
+        Z = X == 0;
+        N = X & 0x80;
+    }
+
+    void DEY()
+    {
+        Y--;
+
+        Z = Y == 0;
+        N = Y & 0x80;
+    }
+
+    // Logic
+    void AND(const Byte b)
+    {
+        A &= b;
+
+        Z = A == 0;
+        N = A & 0x80;
+    }
+
+    void ORA(const Byte b)
+    {
+        A |= b;
+
+        Z = A == 0;
+        N = A & 0x80;
+    }
+
+    void EOR(const Byte b)
+    {
+        A ^= b;
+
+        Z = A == 0;
+        N = A & 0x80;
+    }
+
+    // Comparisons
+    void CMP(const Byte b)
+    {
+        const Byte diff = static_cast<Word>(A) - static_cast<Word>(b) & 0xFF;
+
+        N = diff & 0x80;
+        C = A >= b;
+        Z = A == b;
+    }
+
+    void CPX(const Byte b)
+    {
+        const Byte diff = static_cast<Word>(X) - static_cast<Word>(b) & 0xFF;
+
+        N = diff & 0x80;
+        C = X >= b;
+        Z = X == b;
+    }
+
+    void CPY(const Byte b)
+    {
+        const Byte diff = static_cast<Word>(Y) - static_cast<Word>(b) & 0xFF;
+
+        N = diff & 0x80;
+        C = Y >= b;
+        Z = Y == b;
+    }
+
+    // Shifts, on A or through Modify
+    Byte ASL(Byte b)
+    {
+        C = b & 0x80;
+        b <<= 1;
+
+        Z = b == 0;
+        N = b & 0x80;
+        return b;
+    }
+
+    Byte LSR(Byte b)
+    {
+        C = b & 0x01;
+        b >>= 1;
+
+        Z = b == 0;
+        N = b & 0x80;
+        return b;
+    }
+
+    // Rotations
+    Byte ROL(const Byte b)
+    {
+        Byte temp = b;
+        temp <<= 1;
+        temp &= 0b11111110;
+        temp += C;
+
+        C = b >> 7;
+
+        Z = temp == 0;
+        N = temp & 0x80;
+        return temp;
+    }
+
+    Byte ROR(const Byte b)
+    {
+        Byte temp = b;
+        temp >>= 1;
+        temp &= 0b01111111;
+        temp += C << 7;
+
+        C = b & 1;
+
+        Z = temp == 0;
+        N = temp & 0x80;
+        return temp;
+    }
+
+    // Jumps/Subroutines
+    void JMP(const Word addr)
+    {
+        PC = addr;
+        Edge(PC);
+    }
+
+    // Pushes the address of its own last byte, the high byte is fetched after the pushes
+    template <bool Exact>
+    void JSR()
+    {
+        Word addr = FetchByte<Exact>();
+        DummyRead<Exact>(SPToAddress());
+        Push<Exact>(PC >> 8);
+        Push<Exact>(PC & 0xFF);
+        addr |= Read<Exact>(PC) << 8;
+
+        PC = addr;
+        Edge(PC);
+    }
+
+    template <bool Exact>
+    void RTS()
+    {
+        Implied<Exact>();
+        DummyRead<Exact>(SPToAddress());
+        PC = Pull<Exact>();
+        PC |= Pull<Exact>() << 8;
+        DummyRead<Exact>(PC);
+        PC++;
+        Edge(PC);
+    }
+
+    // Branches, a cycle more when taken and another when the target is on a different page
+    template <bool Exact>
+    void Branch(const bool taken)
+    {
+        const Word addr = PC + 1 + static_cast<int8_t>(Read<Exact>(PC));
+        PC++;
+        if (taken)
+        {
+            DummyRead<Exact>(PC);
+            extraCycles++;
+
+            if ((addr & 0xFF00) != (PC & 0xFF00))
+            {
+                DummyRead<Exact>((PC & 0xFF00) | (addr & 0x00FF));
+                extraCycles++;
+            }
+
+            PC = addr;
+        }
+        Edge(PC);
+    }
+
+    // Interrupts
+    template <bool Exact>
+    void BRK()
+    {
+        // Skips the padding byte after the opcode
+        FetchByte<Exact>();
+        Push<Exact>(PC >> 8);
+        Push<Exact>(PC & 0xFF);
+        // B is always set when pushed by PHP/BRK
+        Push<Exact>(Status() | 0b00010000);
+        B = true;
+        I = true;
+
+        // Read IRQ interrupt vector
+        PC = Read<Exact>(0xFFFE);
+        PC |= Read<Exact>(0xFFFF) << 8;
+        Edge(PC);
+    }
+
+    template <bool Exact>
+    void RTI()
+    {
+        Implied<Exact>();
+        DummyRead<Exact>(SPToAddress());
+
+        // B isn't a real flag so it's left alone
+        const bool b = B;
+        SetStatus(Pull<Exact>());
+        B = b;
+
+        PC = Pull<Exact>();
+        PC |= Pull<Exact>() << 8;
+        Edge(PC);
+    }
+
+    // Flags
+    void CLC()
+    {
+        C = false;
+    }
+
+    void SEC()
+    {
+        C = true;
+    }
+
+    void CLD()
+    {
+        D = false;
+    }
+
+    void SED()
+    {
+        D = true;
+    }
+
+    void CLI()
+    {
+        I = false;
+    }
+
+    void SEI()
+    {
+        I = true;
+    }
+
+    void CLV()
+    {
+        V = false;
+    }
+
+    // TODO: Add decimal flag support for math instructions
+    // Arithmetic
+    void ADC(const Byte b)
+    {
+        const Word sum = b + A + C;
+
+        V = (A ^ sum) & (b ^ sum) & 0x0080;
+        C = sum & 0xFF00;
+        Z = (sum & 0x00FF) == 0;
+        N = sum & 0x0080;
+
+        A = sum & 0x00FF;
+    }
+
+    void SBC(const Byte b)
+    {
+        ADC(b ^ 0x00FF);
+    }
+};
+
+// 6551 ACIA, attached at 0x5100 (registers repeat every 4 bytes)
+// 0: transmit / receive data
+// 1: status (writing resets the chip)
+// 2: command
+// 3: control (baud rate, word length, stop bits)
+// Behaves like the original 6551, TDRE and the transmit interrupt work (unlike the W65C51N)
+// Bytes move at the programmed baud rate through scheduler events, to and from ring buffers that a host thread
+// services in batches (stdin/stdout, a file or a pty), so the CPU thread never makes a syscall
+struct ACIA : Device
+{
+    static constexpr Word BASE = 0x5100;
+    static constexpr Byte IRQ_LINE = 0x01;
+
+    // Status bits
+    static constexpr Byte IRQ = 0x80;
+    static constexpr Byte TDRE = 0x10;
+    static constexpr Byte RDRF = 0x08;
+
+    static constexpr uint BUFFER_SIZE = 4096;
+
+    CPU6502* cpu;
+
+    Byte status = TDRE;
+    Byte command = 0;
+    Byte control = 0;
+    Byte rxData = 0;
+    // Transmit data register, and the shift register it moves to when that's free (TDRE means the former is empty)
+    Byte txData = 0;
+    Byte txShift = 0;
+    bool shifting = false;
+
+    int rxEvent = -1;
+    int txEvent = -1;
+
+    SpscQueue<Byte, BUFFER_SIZE> rx; // host -> emulator
+    SpscQueue<Byte, BUFFER_SIZE> tx; // emulator -> host
+    // Whether anything empties tx (the host thread or a network link), sent bytes are dropped on the floor otherwise
+    bool drained = false;
+
+    int inFd = -1;
+    int outFd = -1;
+    std::thread host;
+    std::atomic<bool> closing{false};
+
+    explicit ACIA(CPU6502* cpu)
+    {
+        this->cpu = cpu;
+    }
+
+    ~ACIA()
+    {
+        Close();
+    }
+
+    void Attach(Bus* bus)
+    {
+        bus->Attach(this, BASE >> 8);
+        rxEvent = cpu->scheduler.Add([this](const Cycles now) { Receive(now); });
+        txEvent = cpu->scheduler.Add([this](const Cycles now) { Transmitted(now); });
+    }
+
+    // 1 start bit, data bits, optional parity bit and stop bits
+    Cycles CharacterTime() const
+    {
+        static constexpr float BAUD_RATES[16] = { 115200, 50, 75, 109.92f, 134.58f, 150, 300, 600, 1200, 1800, 2400, 3600, 4800, 7200, 9600, 19200 };
+        const int dataBits = 8 - (control >> 5 & 0b11);
+        const int bits = 1 + dataBits + (command >> 5 & 1) + (control & 0x80 ? 2 : 1);
+        const float cyclesPerSecond = 1000.0f / clockTime;
+        return std::max(1ull, static_cast<Cycles>(bits * cyclesPerSecond / BAUD_RATES[control & 0x0F]));
+    }
+
+    bool ReceiverEnabled() const
+    {
+        return command & 0x01;
+    }
+
+    void UpdateIRQ()
+    {
+        bool irq = false;
+        // Receive interrupts are enabled when bit 1 is clear, transmit interrupts when bits 2-3 are 01
+        if (ReceiverEnabled() && !(command & 0x02) && status & RDRF) irq = true;
+        if (ReceiverEnabled() && (command & 0x0C) == 0x04 && status & TDRE) irq = true;
+
+        if (irq) status |= IRQ;
+        cpu->SetIRQ(IRQ_LINE, irq);
+    }
+
+    // Next byte from the host, through the input log if there is one
+    bool Next(const Cycles now, uint& b)
+    {
+        const auto pop = [this](uint& value)
+        {
+            Byte c;
+            if (!rx.Pop(c)) return false;
+            value = c;
+            return true;
+        };
+        if (cpu->inputLog != nullptr) return cpu->inputLog->Input(InputLog::Serial, now, b, pop);
+        return pop(b);
+    }
+
+    void Receive(const Cycles now)
+    {
+        if (!ReceiverEnabled()) return;
+
+        // Waits for the program to read the last byte instead of overrunning
+        uint b;
+        if (!(status & RDRF) && Next(now, b))
+        {
+            rxData = b;
+            status |= RDRF;
+            UpdateIRQ();
+
+            // Echo mode
+            if (command & 0x10 && drained) tx.Push(b);
+        }
+        cpu->scheduler.Schedule(rxEvent, now + CharacterTime());
+    }
+
+    // Moves the data register to the shift register and starts sending it
+    void StartShift(const Cycles now)
+    {
+        txShift = txData;
+        shifting = true;
+        status |= TDRE;
+        UpdateIRQ();
+        cpu->scheduler.Schedule(txEvent, now + CharacterTime());
+    }
+
+    void Transmitted(const Cycles now)
+    {
+        // Host is behind, hold the byte until there's room
+        if (drained && !tx.Push(txShift))
+        {
+            cpu->scheduler.Schedule(txEvent, now + CharacterTime());
+            return;
+        }
+
+        shifting = false;
+        if (!(status & TDRE)) StartShift(now);
+    }
+
+    Byte ReadByte(const Word addr) override
+    {
+        const Byte b = Peek(addr);
+        switch (addr & 0x03)
+        {
+            case 0:
+                status &= ~RDRF;
+                UpdateIRQ();
+                break;
+            case 1:
+                // Reading status clears the interrupt flag
+                status &= ~IRQ;
+                break;
+        }
+        return b;
+    }
+
+    Byte Peek(const Word addr) override
+    {
+        switch (addr & 0x03)
+        {
+            case 0: return rxData;
+            case 1: return status;
+            case 2: return command;
+            default: return control;
+        }
+    }
+
+    void WriteByte(const Word addr, const Byte b) override
+    {
+        switch (addr & 0x03)
+        {
+            case 0:
+                // Waits in the data register if a byte is still being shifted out (a second write before it's moved replaces it)
+                txData = b;
+                status &= ~TDRE;
+                if (shifting) UpdateIRQ();
+                else StartShift(cpu->numCycles);
+                break;
+            case 1:
+                // Programmed reset
+                command &= 0xE0;
+                status &= ~0x04;
+                UpdateIRQ();
+                break;
+            case 2:
+                command = b;
+                if (ReceiverEnabled()) cpu->scheduler.Schedule(rxEvent, cpu->numCycles + CharacterTime());
+                UpdateIRQ();
+                break;
+            case 3:
+                control = b;
+                break;
+        }
+    }
+
+#ifndef _WIN32
+    // stdio, pty or file:<input>[,<output>] (output defaults to stdout)
+    bool Open(const std::string& where)
+    {
+        if (where == "stdio")
+        {
+            inFd = STDIN_FILENO;
+            outFd = STDOUT_FILENO;
+        }
+        else if (where == "pty")
+        {
+            inFd = outFd = posix_openpt(O_RDWR | O_NOCTTY);
+            if (inFd < 0 || grantpt(inFd) != 0 || unlockpt(inFd) != 0) return false;
+            std::cout << "ACIA is on " << ptsname(inFd) << std::endl;
+        }
+        else if (where.rfind("file:", 0) == 0)
+        {
+            const std::string files = where.substr(5);
+            const size_t comma = files.find(',');
+            inFd = open(files.substr(0, comma).c_str(), O_RDONLY);
+            outFd = comma == std::string::npos ? STDOUT_FILENO : open(files.substr(comma + 1).c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            if (inFd < 0 || outFd < 0) return false;
+        }
+        else
+        {
+            return false;
+        }
+
+        drained = true;
+        host = std::thread(&ACIA::Service, this);
+        return true;
+    }
+
+    // Host side: moves whatever has piled up in each direction with one read/write at a time
+    void Service()
+    {
+        Byte buffer[BUFFER_SIZE];
+        bool inputOpen = true;
+
+        // Taken from tx but not written yet, when the other end wasn't ready for all of it
+        Byte out[BUFFER_SIZE];
+        uint outLength = 0;
+
+        while (true)
+        {
+            while (outLength < BUFFER_SIZE && tx.Pop(out[outLength])) outLength++;
+            const int wrote = Flush(out, outLength);
+            if (wrote < 0) break;
+            if (closing && (outLength == 0 || wrote == 0)) break;
+
+            pollfd p = { inFd, POLLIN, 0 };
+            if (!inputOpen || poll(&p, 1, 2) <= 0)
+            {
+                if (!inputOpen) std::this_thread::sleep_for(std::chrono::milliseconds(2));
+                continue;
+            }
+
+            // Only take as much as there's room for, the rest stays in the OS until the program catches up
+            const uint room = BUFFER_SIZE - (rx.tail.load() - rx.head.load());
+            if (room == 0)
+            {
+                std::this_thread::sleep_for(std::chrono::milliseconds(2));
+                continue;
+            }
+            const ssize_t got = read(inFd, buffer, room);
+            if (got <= 0)
+            {
+                inputOpen = false;
+                continue;
+            }
+            for (ssize_t i = 0; i < got; i++) rx.Push(buffer[i]);
+        }
+    }
+
+    // Writes as much of out as outFd takes without waiting and moves the rest to the front, returns how much went or -1
+    int Flush(Byte* out, uint& length)
+    {
+        uint done = 0;
+        while (done < length)
+        {
+            pollfd p = { outFd, POLLOUT, 0 };
+            // Gives a slow reader a moment to catch up at the end, rather than dropping what's left
+            if (poll(&p, 1, closing ? 100 : 0) <= 0) break;
+
+            const ssize_t wrote = write(outFd, out + done, length - done);
+            if (wrote < 0)
+            {
+                if (errno == EINTR) continue;
+                if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+                return -1;
+            }
+            done += wrote;
+        }
+        memmove(out, out + done, length - done);
+        length -= done;
+        return done;
+    }
+
+    void Close()
+    {
+        if (!host.joinable()) return;
+
+        closing = true;
+        host.join();
+        if (inFd > STDERR_FILENO) close(inFd);
+        if (outFd > STDERR_FILENO && outFd != inFd) close(outFd);
+    }
+#else
+    bool Open(const std::string& where)
+    {
+        std::cout << "The ACIA host connection isn't supported on Windows" << std::endl;
+        return false;
+    }
+
+    void Close() {}
+#endif
+};
+
+// SD card on an SPI controller, attached at 0x5200 (registers repeat every 16 bytes)
+// 0: SPI data, writing shifts a byte out to the card, reading gives the byte that came back
+// 1: control, bit 0 = chip select (1 selects the card), writing bit 1 flushes the image to disk
+//    status reads back bit 0 = chip select, bit 6 = last DMA failed, bit 7 = card inserted
+// 2-5: DMA block number (little endian)
+// 6-7: DMA memory address
+// 8: DMA command, 1 = read the block into memory, 2 = write the block from memory
+// The card speaks SPI mode as an SDHC card (block addressed) with CMD0/8/9/12/13/16/17/18/24/55/58 and ACMD41,
+// transfers finish instantly. DMA skips the protocol for fast booting and takes DMA_CYCLES per block.
+// The image is mmap'd so blocks are read and written in place, the OS writes changes back and a flush forces it.
+struct SDCard : Device
+{
+    static constexpr Word BASE = 0x5200;
+    static constexpr int BLOCK_SIZE = 512;
+    static constexpr uint DMA_CYCLES = 4;
+
+    // Status bits
+    static constexpr Byte SELECTED = 0x01;
+    static constexpr Byte DMA_ERROR = 0x40;
+    static constexpr Byte INSERTED = 0x80;
+
+    // R1 response bits
+    static constexpr Byte R1_IDLE = 0x01;
+    static constexpr Byte R1_ILLEGAL = 0x04;
+    static constexpr Byte R1_ADDRESS = 0x20;
+
+    // Data tokens
+    static constexpr Byte START_BLOCK = 0xFE;
+    static constexpr Byte DATA_ACCEPTED = 0x05;
+    static constexpr Byte OUT_OF_RANGE = 0x08;
+
+    enum class State { Command, WriteToken, WriteData };
+
+    CPU6502* cpu;
+    Bus* bus;
+
+    Byte* image = nullptr;
+    size_t imageSize = 0;
+    uint32_t blocks = 0;
+
+    bool selected = false;
+    bool dmaError = false;
+    Byte data = 0xFF;
+    uint32_t dmaBlock = 0;
+    Word dmaAddress = 0;
+    Byte dmaCommand = 0;
+
+    // Card side of the protocol
+    State state = State::Command;
+    bool idle = true;
+    bool appCommand = false;
+    Byte command[6];
+    int commandLength = 0;
+    uint32_t block = 0;
+    bool reading = false; // CMD18 keeps sending blocks until CMD12
+    Byte writeBuffer[BLOCK_SIZE + 2]; // + CRC
+    int writeLength = 0;
+
+    // Bytes waiting to be clocked out to the host
+    Byte response[BLOCK_SIZE + 8];
+    int responseLength = 0;
+    int responseIndex = 0;
+
+    SDCard(CPU6502* cpu, Bus* bus)
+    {
+        this->cpu = cpu;
+        this->bus = bus;
+    }
+
+    void Attach()
+    {
+        bus->Attach(this, BASE >> 8);
+    }
+
+    // CRC16-CCITT, what the card sends after each block
+    static Word Crc16(const Byte* p, const int len)
+    {
+        Word crc = 0;
+        for (int i = 0; i < len; i++)
+        {
+            crc ^= p[i] << 8;
+            for (int j = 0; j < 8; j++)
+            {
+                crc = crc & 0x8000 ? crc << 1 ^ 0x1021 : crc << 1;
+            }
+        }
+        return crc;
+    }
+
+    void Respond(const Byte b)
+    {
+        response[responseLength++] = b;
+    }
+
+    void Respond(const Byte* p, const int len)
+    {
+        memcpy(response + responseLength, p, len);
+        responseLength += len;
+    }
+
+    void QueueBlock()
+    {
+        if (block >= blocks)
+        {
+            Respond(OUT_OF_RANGE);
+            reading = false;
+            return;
+        }
+
+        const Byte* p = image + static_cast<size_t>(block) * BLOCK_SIZE;
+        const Word crc = Crc16(p, BLOCK_SIZE);
+        Respond(0xFF);
+        Respond(START_BLOCK);
+        Respond(p, BLOCK_SIZE);
+        Respond(crc >> 8);
+        Respond(crc & 0xFF);
+        block++;
+    }
+
+    void Execute()
+    {
+        const Byte index = command[0] & 0x3F;
+        const uint32_t arg = static_cast<uint32_t>(command[1]) << 24 | command[2] << 16 | command[3] << 8 | command[4];
+        const bool app = appCommand;
+        appCommand = false;
+
+        // CMD12 interrupts a multiple block read, whatever was left of it is dropped
+        responseLength = responseIndex = 0;
+        reading = false;
+
+        // Response comes one byte after the command (NCR)
+        Respond(0xFF);
+        const Byte r1 = idle ? R1_IDLE : 0;
+        if (app && index == 41)
+        {
+            // Ready straight away
+            idle = false;
+            Respond(0);
+            return;
+        }
+
+        switch (index)
+        {
+            case 0:
+                idle = true;
+                Respond(R1_IDLE);
+                break;
+            case 8:
+            {
+                // 2.7-3.6V, echoes the check pattern
+                const Byte r7[5] = { r1, 0, 0, static_cast<Byte>(arg >> 8 & 0x0F), static_cast<Byte>(arg & 0xFF) };
+                Respond(r7, 5);
+                break;
+            }
+            case 9:
+            {
+                // CSD version 2.0, C_SIZE is the capacity in 512KiB units - 1
+                const uint32_t size = std::max(1u, blocks / 1024) - 1;
+                Byte csd[16] = { 0x40, 0x0E, 0x00, 0x32, 0x5B, 0x59, 0x00, static_cast<Byte>(size >> 16 & 0x3F), static_cast<Byte>(size >> 8), static_cast<Byte>(size), 0x7F, 0x80, 0x0A, 0x40, 0x00, 0x01 };
+                const Word crc = Crc16(csd, 16);
+                Respond(r1);
+                Respond(0xFF);
+                Respond(START_BLOCK);
+                Respond(csd, 16);
+                Respond(crc >> 8);
+                Respond(crc & 0xFF);
+                break;
+            }
+            case 12:
+                // Stuff byte, then R1
+                Respond(0);
+                break;
+            case 13:
+                Respond(r1);
+                Respond(0);
+                break;
+            case 16:
+                Respond(arg == BLOCK_SIZE ? r1 : r1 | R1_ILLEGAL);
+                break;
+            case 17:
+            case 18:
+                if (idle)
+                {
+                    Respond(r1 | R1_ILLEGAL);
+                    break;
+                }
+                if (arg >= blocks)
+                {
+                    Respond(R1_ADDRESS);
+                    break;
+                }
+                Respond(0);
+                block = arg;
+                reading = index == 18;
+                QueueBlock();
+                break;
+            case 24:
+                if (idle)
+                {
+                    Respond(r1 | R1_ILLEGAL);
+                    break;
+                }
+                if (arg >= blocks)
+                {
+                    Respond(R1_ADDRESS);
+                    break;
+                }
+                Respond(0);
+                block = arg;
+                state = State::WriteToken;
+                break;
+            case 55:
+                appCommand = true;
+                Respond(r1);
+                break;
+            case 58:
+            {
+                // Powered up, CCS set (block addressing)
+                const Byte r3[5] = { r1, 0xC0, 0xFF, 0x80, 0x00 };
+                Respond(r3, 5);
+                break;
+            }
+            default:
+                Respond(r1 | R1_ILLEGAL);
+                break;
+        }
+    }
+
+    // One byte each way over SPI
+    Byte Transfer(const Byte in)
+    {
+        if (!selected || !image) return 0xFF;
+
+        Byte out = 0xFF;
+        if (responseIndex < responseLength)
+        {
+            out = response[responseIndex++];
+            if (responseIndex == responseLength)
+            {
+                responseLength = responseIndex = 0;
+                if (reading) QueueBlock();
+            }
+        }
+
+        switch (state)
+        {
+            case State::Command:
+                // Commands start with 01 in the top bits, anything else is filler
+                if (commandLength == 0 && (in & 0xC0) != 0x40) break;
+                command[commandLength++] = in;
+                if (commandLength == 6)
+                {
+                    commandLength = 0;
+                    Execute();
+                }
+                break;
+            case State::WriteToken:
+                if (in == START_BLOCK)
+                {
+                    writeLength = 0;
+                    state = State::WriteData;
+                }
+                break;
+            case State::WriteData:
+                writeBuffer[writeLength++] = in;
+                if (writeLength == BLOCK_SIZE + 2)
+                {
+                    memcpy(image + static_cast<size_t>(block) * BLOCK_SIZE, writeBuffer, BLOCK_SIZE);
+                    state = State::Command;
+                    // Data response, then busy for a byte
+                    Respond(0xE0 | DATA_ACCEPTED);
+                    Respond(0);
+                }
+                break;
+        }
+        return out;
+    }
+
+    // Copies a whole block between the image and memory through the bus, so ROM stays read only
+    void Dma()
+    {
+        dmaError = !image || dmaBlock >= blocks || (dmaCommand != 1 && dmaCommand != 2);
+        if (dmaError) return;
+
+        Byte* p = image + static_cast<size_t>(dmaBlock) * BLOCK_SIZE;
+        for (int i = 0; i < BLOCK_SIZE; i++)
+        {
+            const Word addr = dmaAddress + i;
+            if (dmaCommand == 1)
+            {
+                bus->WriteByte(addr, p[i]);
+            }
+            else
+            {
+                p[i] = bus->ReadByte(addr);
+            }
+        }
+        cpu->Clock(DMA_CYCLES);
+    }
+
+    Byte ReadByte(const Word addr) override
+    {
+        return Peek(addr);
+    }
+
+    Byte Peek(const Word addr) override
+    {
+        switch (addr & 0x0F)
+        {
+            case 0: return data;
+            case 1: return (selected ? SELECTED : 0) | (dmaError ? DMA_ERROR : 0) | (image ? INSERTED : 0);
+            case 2: case 3: case 4: case 5: return dmaBlock >> ((addr & 0x0F) - 2) * 8;
+            case 6: return dmaAddress & 0xFF;
+            case 7: return dmaAddress >> 8;
+            case 8: return dmaCommand;
+            default: return 0;
+        }
+    }
+
+    void WriteByte(const Word addr, const Byte b) override
+    {
+        switch (addr & 0x0F)
+        {
+            case 0:
+                data = Transfer(b);
+                break;
+            case 1:
+            {
+                // Deselecting drops whatever the card was in the middle of
+                const bool select = b & SELECTED;
+                if (selected && !select)
+                {
+                    commandLength = responseLength = responseIndex = 0;
+                    reading = false;
+                    state = State::Command;
+                }
+                selected = select;
+                if (b & 0x02) Flush();
+                break;
+            }
+            case 2: case 3: case 4: case 5:
+            {
+                const int shift = ((addr & 0x0F) - 2) * 8;
+                dmaBlock = (dmaBlock & ~(0xFFu << shift)) | static_cast<uint32_t>(b) << shift;
+                break;
+            }
+            case 6:
+                dmaAddress = (dmaAddress & 0xFF00) | b;
+                break;
+            case 7:
+                dmaAddress = (dmaAddress & 0x00FF) | b << 8;
+                break;
+            case 8:
+                dmaCommand = b;
+                Dma();
+                break;
+        }
+    }
+
+#ifndef _WIN32
+    // Maps the image in shared, anything past the last whole block is ignored
+    bool Open(const std::string& path)
+    {
+        const int fd = open(path.c_str(), O_RDWR);
+        if (fd < 0) return false;
+
+        struct stat st;
+        if (fstat(fd, &st) != 0 || st.st_size < BLOCK_SIZE)
+        {
+            close(fd);
+            return false;
+        }
+
+        void* p = mmap(nullptr, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        // The mapping keeps the file open
+        close(fd);
+        if (p == MAP_FAILED) return false;
+
+        image = static_cast<Byte*>(p);
+        imageSize = st.st_size;
+        blocks = static_cast<uint32_t>(std::min<size_t>(imageSize / BLOCK_SIZE, 0xFFFFFFFFu));
+        return true;
+    }
+
+    void Flush()
+    {
+        if (image) msync(image, imageSize, MS_SYNC);
+    }
+
+    void Close()
+    {
+        if (!image) return;
+
+        Flush();
+        munmap(image, imageSize);
+        image = nullptr;
+    }
+#else
+    bool Open(const std::string& path)
+    {
+        std::cout << "SD card images aren't supported on Windows" << std::endl;
+        return false;
+    }
+
+    void Flush() {}
+    void Close() {}
+#endif
+};
+
+// Battery backed RAM: RAM (and VRAM after it in the file with --nvram-vram) is a file mmap'd in place of the bus's
+// memory, so whatever the firmware leaves there is still there next run. Nothing is read up front, pages come in as
+// they're touched, and a new or short file is grown with zeros so it starts out like normal RAM
+// Sync policies (--nvram-sync=): exit (default) msyncs on the way out, <ms> also msyncs that often from a host thread
+// so a crash loses less, never leaves it all to the OS (changes still reach the file unless the host goes down first)
+struct NVRAM
+{
+    static constexpr int RAM_PAGES = 0x60;
+    static constexpr int VRAM_PAGES = 0x20;
+
+    static constexpr int SYNC_NEVER = -1;
+    static constexpr int SYNC_ON_EXIT = 0;
+
+    Byte* memory = nullptr;
+    size_t size = 0;
+    bool vram = false;
+    int syncPeriod = SYNC_ON_EXIT; // ms
+
+    std::thread syncer;
+    std::atomic<bool> closing{false};
+
+    ~NVRAM()
+    {
+        Close();
+    }
+
+    // Before any devices attach, so they (and the MMU's unmapped windows) see the file as the normal memory
+    void Attach(Bus* bus)
+    {
+        if (memory == nullptr) return;
+
+        bus->Map(0x00, RAM_PAGES, memory, true);
+        if (vram) bus->Map(0x60, VRAM_PAGES, memory + RAM_PAGES * Bus::PAGE_SIZE, true);
+    }
+
+#ifndef _WIN32
+    bool Open(const std::string& path)
+    {
+        const int fd = open(path.c_str(), O_RDWR | O_CREAT, 0644);
+        if (fd < 0) return false;
+
+        size = (RAM_PAGES + (vram ? VRAM_PAGES : 0)) * Bus::PAGE_SIZE;
+        struct stat st;
+        if (fstat(fd, &st) != 0 || (static_cast<size_t>(st.st_size) < size && ftruncate(fd, size) != 0))
+        {
+            close(fd);
+            return false;
+        }
+
+        void* p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        // The mapping keeps the file open
+        close(fd);
+        if (p == MAP_FAILED) return false;
+
+        memory = static_cast<Byte*>(p);
+        if (syncPeriod > 0) syncer = std::thread(&NVRAM::Syncer, this);
+        return true;
+    }
+
+    void Sync()
+    {
+        if (memory) msync(memory, size, MS_SYNC);
+    }
+
+    void Syncer()
+    {
+        while (!closing)
+        {
+            // Short sleeps so closing doesn't wait out a long period
+            for (int waited = 0; waited < syncPeriod && !closing; waited += 10)
+            {
+                std::this_thread::sleep_for(std::chrono::milliseconds(10));
+            }
+            Sync();
+        }
+    }
+
+    void Close()
+    {
+        if (!memory) return;
+
+        closing = true;
+        if (syncer.joinable()) syncer.join();
+        if (syncPeriod != SYNC_NEVER) Sync();
+        munmap(memory, size);
+        memory = nullptr;
+    }
+#else
+    bool Open(const std::string& path)
+    {
+        std::cout << "NVRAM files aren't supported on Windows" << std::endl;
+        return false;
+    }
+
+    void Sync() {}
+    void Close() {}
+#endif
+};
+
+// Bank switching MMU, attached at 0x5300 (registers repeat every 16 bytes)
+// Four 8K windows at 0x2000, 0x8000, 0xA000 and 0xC000 (0xE000 - 0xFFFF always stays put for the vectors and switching code)
+// each show a bank of a large RAM or ROM store, 4 registers per window:
+// 0-1: bank number in 8K units (little endian), wraps around the size of the store
+// 2: control, bit 0 = mapped (0 shows the normal memory), bit 1 = 16K (also covers the next window's 8K with bank + 1,
+//    unless that window is mapped itself), bit 2 = ROM store (read only) instead of RAM
+// A 16K window at 0x2000 stops short of the device pages, one at 0xC000 is just 8K
+// Switching only repoints the bus's page table, accesses through a window cost the same as any other memory
+struct MMU : Device
+{
+    static constexpr Word BASE = 0x5300;
+    static constexpr int NUM_WINDOWS = 4;
+    static constexpr int BANK_SIZE = 0x2000;
+    static constexpr int BANK_PAGES = BANK_SIZE / Bus::PAGE_SIZE;
+    static constexpr Byte WINDOW_PAGES[NUM_WINDOWS] = { 0x20, 0x80, 0xA0, 0xC0 };
+    static constexpr int FIXED_PAGE = 0xE0;
+
+    // Control bits
+    static constexpr Byte MAPPED = 0x01;
+    static constexpr Byte WIDE = 0x02;
+    static constexpr Byte ROM_STORE = 0x04;
+
+    Bus* bus;
+
+    std::vector<Byte> ram;
+    std::vector<Byte> rom;
+
+    Word banks[NUM_WINDOWS] = {};
+    Byte controls[NUM_WINDOWS] = {};
+
+    // What the bus had under the windows before anything was mapped
+    Byte* native[Bus::NUM_PAGES] = {};
+    bool nativeWritable[Bus::NUM_PAGES] = {};
+
+    explicit MMU(Bus* bus)
+    {
+        this->bus = bus;
+    }
+
+    // ramSize in bytes, rounded up to whole banks
+    void Attach(const size_t ramSize)
+    {
+        ram.assign((ramSize + BANK_SIZE - 1) / BANK_SIZE * BANK_SIZE, 0);
+        for (int page = 0; page < Bus::NUM_PAGES; page++)
+        {
+            native[page] = bus->memory[page];
+            nativeWritable[page] = bus->writable[page];
+        }
+        bus->Attach(this, BASE >> 8);
+    }
+
+    bool LoadRom(const std::string& path)
+    {
+        std::ifstream f(path, std::ios::binary);
+        if (!f.is_open()) return false;
+        rom.assign(std::istreambuf_iterator<char>(f), std::istreambuf_iterator<char>());
+        rom.resize((rom.size() + BANK_SIZE - 1) / BANK_SIZE * BANK_SIZE, 0xFF);
+        return !rom.empty();
+    }
+
+    // Memory for a page of window w's slot, offset banks into the window's bank (16K windows span two)
+    Byte* Source(const int w, const int offset, bool& writable)
+    {
+        std::vector<Byte>& store = controls[w] & ROM_STORE ? rom : ram;
+        if (store.empty()) return nullptr;
+
+        const size_t numBanks = store.size() / BANK_SIZE;
+        const size_t bank = (banks[w] + offset / BANK_PAGES) % numBanks;
+        writable = &store == &ram;
+        return store.data() + bank * BANK_SIZE + offset % BANK_PAGES * Bus::PAGE_SIZE;
+    }
+
+    // Puts back whatever should be at the pages of window w's slot: the window itself, the one before it if
+    // that's 16K, or the normal memory
+    void Remap(const int w)
+    {
+        for (int i = 0; i < BANK_PAGES; i++)
+        {
+            const int page = WINDOW_PAGES[w] + i;
+            if (bus->devices[page] != nullptr) continue;
+
+            bool writable = nativeWritable[page];
+            Byte* mem = nullptr;
+            if (controls[w] & MAPPED)
+            {
+                mem = Source(w, i, writable);
+            }
+            else if (w > 0 && (controls[w - 1] & (MAPPED | WIDE)) == (MAPPED | WIDE) && WINDOW_PAGES[w - 1] + BANK_PAGES == WINDOW_PAGES[w])
+            {
+                mem = Source(w - 1, BANK_PAGES + i, writable);
+            }
+            if (mem == nullptr)
+            {
+                mem = native[page];
+                writable = nativeWritable[page];
+            }
+
+            if (bus->memory[page] != mem || bus->writable[page] != writable) bus->Map(page, 1, mem, writable);
+        }
+    }
+
+    // The part of a 16K window past its own slot when the next window doesn't take it (i.e. 0x2000 -> 0x4000)
+    void RemapSpill(const int w)
+    {
+        if (w + 1 < NUM_WINDOWS && WINDOW_PAGES[w] + BANK_PAGES == WINDOW_PAGES[w + 1])
+        {
+            Remap(w + 1);
+            return;
+        }
+
+        for (int i = 0; i < BANK_PAGES; i++)
+        {
+            const int page = WINDOW_PAGES[w] + BANK_PAGES + i;
+            if (page >= FIXED_PAGE || bus->devices[page] != nullptr) continue;
+
+            bool writable = nativeWritable[page];
+            Byte* mem = (controls[w] & (MAPPED | WIDE)) == (MAPPED | WIDE) ? Source(w, BANK_PAGES + i, writable) : nullptr;
+            if (mem == nullptr)
+            {
+                mem = native[page];
+                writable = nativeWritable[page];
+            }
+
+            if (bus->memory[page] != mem || bus->writable[page] != writable) bus->Map(page, 1, mem, writable);
+        }
+    }
+
+    Byte ReadByte(const Word addr) override
+    {
+        return Peek(addr);
+    }
+
+    void WriteByte(const Word addr, const Byte b) override
+    {
+        const int w = (addr & 0x0F) / 4;
+        switch (addr & 0x03)
+        {
+            case 0:
+                banks[w] = (banks[w] & 0xFF00) | b;
+                break;
+            case 1:
+                banks[w] = (banks[w] & 0x00FF) | b << 8;
+                break;
+            case 2:
+                controls[w] = b & (MAPPED | WIDE | ROM_STORE);
+                break;
+            default:
+                return;
+        }
+
+        Remap(w);
+        RemapSpill(w);
+    }
+
+    // After the registers were set directly (putting a snapshot back)
+    void RemapAll()
+    {
+        for (int w = 0; w < NUM_WINDOWS; w++)
+        {
+            Remap(w);
+            RemapSpill(w);
+        }
+    }
+
+    Byte Peek(const Word addr) override
+    {
+        const int w = (addr & 0x0F) / 4;
+        switch (addr & 0x03)
+        {
+            case 0:
+                return banks[w] & 0xFF;
+            case 1:
+                return banks[w] >> 8;
+            case 2:
+                return controls[w];
+            default:
+                return 0;
+        }
+    }
+};
+
+// Programmable sound generator, attached at 0x5400 (registers repeat every 16 bytes)
+// Channels 0-2 are square waves, channel 3 is noise, 4 registers per channel:
+// 0-1: period (12 bits, little endian), the channel runs at CLOCK / (16 * period) Hz (0 = silent)
+// 2: volume, 0 - 15 in 1.5 dB steps (0 = silent)
+// Writes are stamped with the cycle they happened at and played back at that point when a frame's worth of samples
+// is made in one go (from a scheduler event), so sound costs a block per frame instead of work per cycle
+// The samples go to SDL audio, to a WAV file (--wav=) or both, mono 16 bit
+struct PSG : Device
+{
+    static constexpr Word BASE = 0x5400;
+    static constexpr int NUM_CHANNELS = 4;
+    static constexpr int NOISE = 3;
+    static constexpr float CLOCK = 1000000.0f;
+    static constexpr int SAMPLE_RATE = 44100;
+
+    CPU6502* cpu;
+
+    Byte regs[16] = {};
+
+    struct Write
+    {
+        Cycles when;
+        Byte reg;
+        Byte value;
+    };
+    std::vector<Write> writes;
+
+    // What the synthesizer is up to, lags the registers by up to a frame
+    Word periods[NUM_CHANNELS] = {};
+    Byte volumes[NUM_CHANNELS] = {};
+    float phases[NUM_CHANNELS] = {};
+    Word noise = 1; // 15 bit LFSR
+    double sampleCycle = 0;
+
+    std::vector<int16_t> block;
+    int event = -1;
+    bool output = false;
+
+    SDL_AudioDeviceID device = 0;
+    std::ofstream wav;
+    uint32_t wavSamples = 0;
+
+    explicit PSG(CPU6502* cpu)
+    {
+        this->cpu = cpu;
+    }
+
+    void Attach(Bus* bus)
+    {
+        bus->Attach(this, BASE >> 8);
+    }
+
+    // Starts making samples once there's somewhere for them to go
+    void Start()
+    {
+        if (output) return;
+
+        output = true;
+        sampleCycle = cpu->numCycles;
+        event = cpu->scheduler.Add([this](const Cycles now)
+        {
+            Synthesize(now);
+            cpu->scheduler.Schedule(event, now + CyclesPerFrame());
+        });
+        cpu->scheduler.Schedule(event, cpu->numCycles + CyclesPerFrame());
+    }
+
+    bool OpenAudio()
+    {
+        if (SDL_InitSubSystem(SDL_INIT_AUDIO) != 0) return false;
+
+        SDL_AudioSpec want = {};
+        want.freq = SAMPLE_RATE;
+        want.format = AUDIO_S16SYS;
+        want.channels = 1;
+        want.samples = 1024;
+        device = SDL_OpenAudioDevice(nullptr, 0, &want, nullptr, 0);
+        if (device == 0) return false;
+
+        SDL_PauseAudioDevice(device, 0);
+        Start();
+        return true;
+    }
+
+    bool OpenWav(const std::string& path)
+    {
+        wav.open(path, std::ios::binary);
+        if (!wav.is_open()) return false;
+
+        // Sizes are filled in by Close
+        WriteWavHeader();
+        Start();
+        return true;
+    }
+
+    void WriteWavHeader()
+    {
+        const auto u32 = [this](const uint32_t v) { wav.write(reinterpret_cast<const char*>(&v), 4); };
+        const auto u16 = [this](const uint16_t v) { wav.write(reinterpret_cast<const char*>(&v), 2); };
+        wav.write("RIFF", 4);
+        u32(36 + wavSamples * 2);
+        wav.write("WAVEfmt ", 8);
+        u32(16);
+        u16(1); // PCM
+        u16(1); // mono
+        u32(SAMPLE_RATE);
+        u32(SAMPLE_RATE * 2);
+        u16(2);
+        u16(16);
+        wav.write("data", 4);
+        u32(wavSamples * 2);
+    }
+
+    void Close()
+    {
+        if (wav.is_open())
+        {
+            wav.seekp(0);
+            WriteWavHeader();
+            wav.close();
+        }
+        if (device != 0)
+        {
+            SDL_CloseAudioDevice(device);
+            device = 0;
+        }
+    }
+
+    Byte ReadByte(const Word addr) override
+    {
+        return Peek(addr);
+    }
+
+    void WriteByte(const Word addr, const Byte b) override
+    {
+        regs[addr & 0x0F] = b;
+        if (output) writes.push_back({ cpu->numCycles, static_cast<Byte>(addr & 0x0F), b });
+    }
+
+    Byte Peek(const Word addr) override
+    {
+        return regs[addr & 0x0F];
+    }
+
+    void Apply(const Write& w)
+    {
+        const int c = w.reg / 4;
+        switch (w.reg & 0x03)
+        {
+            case 0:
+                periods[c] = (periods[c] & 0x0F00) | w.value;
+                break;
+            case 1:
+                periods[c] = (periods[c] & 0x00FF) | (w.value & 0x0F) << 8;
+                break;
+            case 2:
+                volumes[c] = w.value & 0x0F;
+                break;
+        }
+    }
+
+    float Sample()
+    {
+        // Each channel tops out at a quarter of full scale so the mix can't clip
+        static const float LEVELS[16] = {
+            0, 0.0224f, 0.0266f, 0.0316f, 0.0376f, 0.0447f, 0.0531f, 0.0631f,
+            0.0750f, 0.0891f, 0.1059f, 0.1259f, 0.1496f, 0.1778f, 0.2113f, 0.25f,
+        };
+
+        float mix = 0;
+        for (int c = 0; c < NUM_CHANNELS; c++)
+        {
+            if (periods[c] == 0 || volumes[c] == 0) continue;
+
+            phases[c] += CLOCK / (16.0f * periods[c]) / SAMPLE_RATE;
+            if (c == NOISE)
+            {
+                // Steps the LFSR once per period
+                for (; phases[c] >= 1.0f; phases[c] -= 1.0f)
+                {
+                    noise = (noise >> 1) | ((noise ^ noise >> 1) & 1) << 14;
+                }
+                mix += noise & 1 ? LEVELS[volumes[c]] : -LEVELS[volumes[c]];
+            }
+            else
+            {
+                phases[c] -= std::floor(phases[c]);
+                mix += phases[c] < 0.5f ? LEVELS[volumes[c]] : -LEVELS[volumes[c]];
+            }
+        }
+        return mix;
+    }
+
+    // Makes the samples from where the last block stopped up to now, applying each write when its cycle comes up
+    void Synthesize(const Cycles now)
+    {
+        const double cyclesPerSample = 1000.0 / clockTime / SAMPLE_RATE;
+
+        block.clear();
+        size_t next = 0;
+        for (; sampleCycle < now; sampleCycle += cyclesPerSample)
+        {
+            for (; next < writes.size() && writes[next].when <= sampleCycle; next++) Apply(writes[next]);
+            block.push_back(static_cast<int16_t>(Sample() * 32767.0f));
+        }
+        for (; next < writes.size(); next++) Apply(writes[next]);
+        writes.clear();
+
+        if (block.empty()) return;
+        if (wav.is_open())
+        {
+            wav.write(reinterpret_cast<const char*>(block.data()), block.size() * sizeof(int16_t));
+            wavSamples += block.size();
+        }
+        // Turbo makes sound faster than it plays, that's dropped rather than let the queue grow
+        if (device != 0 && SDL_GetQueuedAudioSize(device) < SAMPLE_RATE / 4 * sizeof(int16_t))
+        {
+            SDL_QueueAudio(device, block.data(), block.size() * sizeof(int16_t));
+        }
+    }
+};
+
+// Keyboard, attached at 0x5500 (registers repeat every 16 bytes)
+// 0: data, reading takes the oldest key event off the FIFO: its USB HID usage code (the same numbers as SDL scancodes)
+// 1: status, bit 7 = an event is waiting, bit 6 = that event is a release (read it before the data), bit 0 = IRQ enable
+//    writing sets the IRQ enable bit, the IRQ is held while the FIFO has something in it
+// SDL key events go from the GPU thread into a lock-free queue, the CPU thread moves them into the FIFO POLLS_PER_FRAME
+// times a frame from a scheduler event (and through the input log), so the CPU thread never waits on the GPU thread
+// Keys held down repeat at the host's rate like a real keyboard's typematic repeat
+struct Keyboard : Device
+{
+    static constexpr Word BASE = 0x5500;
+    static constexpr Byte IRQ_LINE = 0x02;
+    static constexpr int POLLS_PER_FRAME = 4;
+    static constexpr int FIFO_SIZE = 16;
+
+    // Status bits
+    static constexpr Byte READY = 0x80;
+    static constexpr Byte RELEASE = 0x40;
+    static constexpr Byte IRQ_ENABLE = 0x01;
+
+    // Event bits above the code
+    static constexpr uint RELEASED = 0x100;
+
+    CPU6502* cpu;
+
+    // GPU thread -> CPU thread
+    SpscQueue<Word, 256> host;
+
+    // What the machine sees, only touched by the CPU thread
+    Word fifo[FIFO_SIZE];
+    int head = 0;
+    int count = 0;
+    Byte control = 0;
+
+    int event = -1;
+
+    explicit Keyboard(CPU6502* cpu)
+    {
+        this->cpu = cpu;
+    }
+
+    void Attach(Bus* bus)
+    {
+        bus->Attach(this, BASE >> 8);
+        event = cpu->scheduler.Add([this](const Cycles now) { Poll(now); });
+        cpu->scheduler.Schedule(event, cpu->numCycles + PollCycles());
+    }
+
+    static Cycles PollCycles()
+    {
+        return std::max(1ull, CyclesPerFrame() / POLLS_PER_FRAME);
+    }
+
+    // GPU thread, a full queue drops the key like a keyboard with nobody reading it
+    void Key(const int scancode, const bool released)
+    {
+        if (scancode <= 0 || scancode > 0xFF) return;
+        host.Push(static_cast<Word>(scancode | (released ? RELEASED : 0)));
+    }
+
+    void Poll(const Cycles now)
+    {
+        const auto pop = [this](uint& value)
+        {
+            Word w;
+            if (!host.Pop(w)) return false;
+            value = w;
+            return true;
+        };
+
+        uint value;
+        while (count < FIFO_SIZE && (cpu->inputLog != nullptr ? cpu->inputLog->Input(InputLog::Key, now, value, pop) : pop(value)))
+        {
+            fifo[(head + count++) % FIFO_SIZE] = value;
+        }
+        UpdateIRQ();
+        cpu->scheduler.Schedule(event, now + PollCycles());
+    }
+
+    void UpdateIRQ()
+    {
+        cpu->SetIRQ(IRQ_LINE, control & IRQ_ENABLE && count > 0);
+    }
+
+    Byte ReadByte(const Word addr) override
+    {
+        const Byte b = Peek(addr);
+        if ((addr & 0x0F) == 0 && count > 0)
+        {
+            head = (head + 1) % FIFO_SIZE;
+            count--;
+            UpdateIRQ();
+        }
+        return b;
+    }
+
+    void WriteByte(const Word addr, const Byte b) override
+    {
+        if ((addr & 0x0F) == 1)
+        {
+            control = b & IRQ_ENABLE;
+            UpdateIRQ();
+        }
+    }
+
+    Byte Peek(const Word addr) override
+    {
+        switch (addr & 0x0F)
+        {
+            case 0:
+                return count > 0 ? fifo[head] & 0xFF : 0;
+            case 1:
+                return (count > 0 ? READY : 0) | (count > 0 && fifo[head] & RELEASED ? RELEASE : 0) | control;
+            default:
+                return 0;
+        }
+    }
+};
+
+// Halts the CPU while the video circuit is drawing the visible area, see VideoTiming
+// Only the halted periods are modeled, charged in bulk through the scheduler rather than per pixel
+struct VideoHalt
+{
+    CPU6502* cpu;
+    int event = -1;
+
+    // Fraction of a cycle left over from the last frame's bulk charge
+    double carry = 0;
+
+    explicit VideoHalt(CPU6502* cpu)
+    {
+        this->cpu = cpu;
+    }
+
+    void Attach()
+    {
+        event = cpu->scheduler.Add([this](const Cycles now) { Halt(now); });
+        cpu->scheduler.Schedule(event, cpu->numCycles);
+    }
+
+    // Frames start at multiples of CyclesPerFrame() so they line up with lockstep's frames
+    void Halt(const Cycles now)
+    {
+        const Cycles frameCycles = CyclesPerFrame();
+        const Cycles frameStart = now - now % frameCycles;
+        const double lineCycles = static_cast<double>(frameCycles) / videoTiming.VTotal();
+        const double activeCycles = lineCycles * videoTiming.hVisible / videoTiming.HTotal();
+
+        if (!haltPerScanline)
+        {
+            // Charge the whole frame's active time up front, then let the CPU run through blanking
+            const double halted = activeCycles * videoTiming.vVisible + carry;
+            const Cycles charge = static_cast<Cycles>(halted);
+            carry = halted - charge;
+            cpu->Clock(charge);
+
+            cpu->scheduler.Schedule(event, frameStart + frameCycles);
+            return;
+        }
+
+        // The CPU may have been busy with an instruction when the line started, only charge what's left of it
+        const int line = static_cast<int>((now - frameStart) / lineCycles);
+        if (line < videoTiming.vVisible)
+        {
+            const Cycles activeEnd = frameStart + static_cast<Cycles>(std::ceil(line * lineCycles + activeCycles));
+            if (activeEnd > now)
+            {
+                cpu->Clock(activeEnd - now);
+            }
+        }
+
+        if (line + 1 < videoTiming.vVisible)
+        {
+            cpu->scheduler.Schedule(event, frameStart + static_cast<Cycles>(std::ceil((line + 1) * lineCycles)));
+        }
+        else
+        {
+            cpu->scheduler.Schedule(event, frameStart + frameCycles);
+        }
+    }
+};
+
+// Video control registers, attached at 0x5000
+// 0: framebuffer page to display (videoMode.pages of them)
+// 1: pixel format (0 = RRGGBB, 1 = indexed)
+// 2: palette index
+// 3: palette data, written as R, G, B then moves on to the next index (like a VGA DAC)
+struct VideoControl : Device
+{
+    static constexpr Word BASE = 0x5000;
+
+    Byte page = 0;
+    PixelFormat format;
+    Byte paletteIndex = 0;
+    Byte paletteComponent = 0;
+
+    // RGBA8888 (R in the low byte)
+    uint32_t palette[256];
+    uint32_t rrggbb[256];
+
+    VideoControl()
+    {
+        format = videoMode.format;
+
+        // The palette starts out the same as RRGGBB
+        for (int i = 0; i < 256; i++)
+        {
+            rrggbb[i] = ((i >> 4 & 0b11) * 85) | ((i >> 2 & 0b11) * 85) << 8 | ((i & 0b11) * 85) << 16 | 0xFFu << 24;
+            palette[i] = rrggbb[i];
+        }
+    }
+
+    Word DisplayBase() const
+    {
+        return videoMode.base + page % videoMode.pages * videoMode.PageSize();
+    }
+
+    const uint32_t* Lut() const
+    {
+        return format == PixelFormat::Indexed ? palette : rrggbb;
+    }
+
+    Byte ReadByte(const Word addr) override
+    {
+        return Peek(addr);
+    }
+
+    Byte Peek(const Word addr) override
+    {
+        switch (addr & 0x03)
+        {
+            case 0: return page;
+            case 1: return format == PixelFormat::Indexed;
+            case 2: return paletteIndex;
+            default: return 0;
+        }
+    }
+
+    void WriteByte(const Word addr, const Byte b) override
+    {
+        switch (addr & 0x03)
+        {
+            case 0:
+                page = b;
+                break;
+            case 1:
+                format = b & 1 ? PixelFormat::Indexed : PixelFormat::RRGGBB;
+                break;
+            case 2:
+                paletteIndex = b;
+                paletteComponent = 0;
+                break;
+            case 3:
+                palette[paletteIndex] = (palette[paletteIndex] & ~(0xFFu << paletteComponent * 8)) | static_cast<uint32_t>(b) << paletteComponent * 8;
+                if (++paletteComponent == 3)
+                {
+                    paletteComponent = 0;
+                    paletteIndex++;
+                }
+                break;
+        }
+    }
+};
+
+// One board: the CPU, memory and devices, without anything on the host side (display, debugger, files)
+struct Machine
+{
+    Bus bus;
+    CPU6502 cpu;
+    VideoControl videoControl;
+    ACIA acia;
+    SDCard sd;
+    MMU mmu;
+    PSG psg;
+    Keyboard keyboard;
+
+    explicit Machine(const size_t bankedRam, NVRAM* nvram = nullptr)
+        : cpu(&bus), acia(&cpu), sd(&cpu, &bus), mmu(&bus), psg(&cpu), keyboard(&cpu)
+    {
+        if (nvram != nullptr) nvram->Attach(&bus);
+        bus.Attach(&videoControl, VideoControl::BASE >> 8);
+        acia.Attach(&bus);
+        sd.Attach();
+        mmu.Attach(bankedRam);
+        psg.Attach(&bus);
+        keyboard.Attach(&bus);
+    }
+
+    void Load(const std::string& romPath)
+    {
+        // RAM backed by an NVRAM file is mapped over these, so clearing them doesn't touch it
+        bus.ram.Initialize();
+        bus.rom.Initialize();
+        bus.vram.Initialize();
+
+        LoadProgram(&bus.rom, romPath);
+    }
+};
+
+// Converts count VRAM bytes to RGBA8888 through lut (one of VideoControl's tables)
+void ConvertPixels(const Byte* src, uint32_t* dst, const int count, const uint32_t* lut, [[maybe_unused]] const PixelFormat format)
+{
+    int i = 0;
+#if defined(__AVX2__)
+    // Gather straight from the lookup table, works for either format
+    for (; i + 8 <= count; i += 8)
+    {
+        const __m256i index = _mm256_cvtepu8_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(src + i)));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + i), _mm256_i32gather_epi32(reinterpret_cast<const int*>(lut), index, 4));
+    }
+#elif defined(__SSE2__)
+    // No gather, but RRGGBB can be expanded directly: each 2 bit channel * 85 is its 8 bit value
+    if (format == PixelFormat::RRGGBB)
+    {
+        const __m128i mask = _mm_set1_epi8(0b11);
+        const __m128i scale = _mm_set1_epi16(85);
+        const __m128i alpha = _mm_set1_epi8(static_cast<char>(0xFF));
+        for (; i + 16 <= count; i += 16)
+        {
+            const __m128i c = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i));
+            // Channels are at most 3 so * 85 never carries into the neighbouring byte of a 16 bit lane
+            const __m128i r = _mm_mullo_epi16(_mm_and_si128(_mm_srli_epi16(c, 4), mask), scale);
+            const __m128i g = _mm_mullo_epi16(_mm_and_si128(_mm_srli_epi16(c, 2), mask), scale);
+            const __m128i b = _mm_mullo_epi16(_mm_and_si128(c, mask), scale);
+
+            const __m128i rgLo = _mm_unpacklo_epi8(r, g);
+            const __m128i rgHi = _mm_unpackhi_epi8(r, g);
+            const __m128i baLo = _mm_unpacklo_epi8(b, alpha);
+            const __m128i baHi = _mm_unpackhi_epi8(b, alpha);
+
+            __m128i* out = reinterpret_cast<__m128i*>(dst + i);
+            _mm_storeu_si128(out + 0, _mm_unpacklo_epi16(rgLo, baLo));
+            _mm_storeu_si128(out + 1, _mm_unpackhi_epi16(rgLo, baLo));
+            _mm_storeu_si128(out + 2, _mm_unpacklo_epi16(rgHi, baHi));
+            _mm_storeu_si128(out + 3, _mm_unpackhi_epi16(rgHi, baHi));
+        }
+    }
+#endif
+    for (; i < count; i++)
+    {
+        dst[i] = lut[src[i]];
+    }
+}
+
+// CPU registers, pending interrupts, scheduler event times and the memory behind every page
+// Device registers aren't included, apart from the MMU's when there is one (the pages above are whatever it had mapped)
+struct Snapshot
+{
+    Word PC;
+    Byte SP, A, X, Y, status;
+    Cycles numCycles;
+    Byte irqLines;
+    bool nmiPending;
+    Cycles events[Scheduler::MAX_EVENTS];
+    Byte memory[Bus::NUM_PAGES][Bus::PAGE_SIZE];
+    Word banks[MMU::NUM_WINDOWS] = {};
+    Byte controls[MMU::NUM_WINDOWS] = {};
+
+    void Save(const CPU6502* cpu, const Bus* bus, const MMU* mmu = nullptr)
+    {
+        PC = cpu->PC;
+        SP = cpu->SP;
+        A = cpu->A;
+        X = cpu->X;
+        Y = cpu->Y;
+        status = cpu->Status();
+        numCycles = cpu->numCycles;
+        irqLines = cpu->irqLines;
+        nmiPending = cpu->nmiPending;
+        for (int i = 0; i < Scheduler::MAX_EVENTS; i++)
+        {
+            events[i] = cpu->scheduler.events[i].when;
+        }
+        for (int page = 0; page < Bus::NUM_PAGES; page++)
+        {
+            if (bus->memory[page]) memcpy(memory[page], bus->memory[page], Bus::PAGE_SIZE);
+        }
+        if (mmu != nullptr)
+        {
+            std::copy(std::begin(mmu->banks), std::end(mmu->banks), banks);
+            std::copy(std::begin(mmu->controls), std::end(mmu->controls), controls);
+        }
+    }
+
+    // Before any RestorePage, so the pages go back into the banks they came from
+    void RestoreMMU(MMU* mmu) const
+    {
+        if (mmu == nullptr) return;
+        std::copy(std::begin(banks), std::end(banks), mmu->banks);
+        std::copy(std::begin(controls), std::end(controls), mmu->controls);
+        mmu->RemapAll();
+    }
+
+    void RestoreCPU(CPU6502* cpu) const
+    {
+        cpu->PC = PC;
+        cpu->SP = SP;
+        cpu->A = A;
+        cpu->X = X;
+        cpu->Y = Y;
+        cpu->SetStatus(status);
+        cpu->numCycles = numCycles;
+        cpu->irqLines = irqLines;
+        cpu->nmiPending = nmiPending;
+        for (int i = 0; i < Scheduler::MAX_EVENTS; i++)
+        {
+            cpu->scheduler.events[i].when = events[i];
+        }
+        cpu->scheduler.Update();
+    }
+
+    void RestorePage(Bus* bus, const int page) const
+    {
+        memcpy(bus->memory[page], memory[page], Bus::PAGE_SIZE);
+    }
+};
+
+// Snapshot fuzzing: runs from reset to the start PC once and snapshots the CPU and memory there, then for each input
+// writes it to RAM, runs until the stop PC (or the cycle limit) and copies back only the pages that were written
+// Device registers aren't part of the snapshot, so inputs should only reach the firmware through memory
+struct FuzzConfig
+{
+    bool enabled = false;
+    Word startPC = 0;
+    Word stopPC = 0;
+    Word inputAddr = 0x0200;
+    Word maxInput = 0x100;
+    int lengthAddr = -1; // Where the input length is stored (a word), -1 for nowhere
+    Cycles maxCycles = 1000000;
+    std::vector<Word> crashPCs; // i.e. a panic handler
+    std::vector<std::string> inputs;
+    uint bench = 0;
+};
+
+FuzzConfig fuzzConfig;
+
+bool ParseFuzzOption(const std::string& arg)
+{
+    const auto value = [&arg]() { return std::stoi(arg.substr(arg.find('=') + 1), nullptr, 0); };
+    if (arg.rfind("--fuzz-start=", 0) == 0)
+    {
+        fuzzConfig.startPC = value();
+        fuzzConfig.enabled = true;
+    }
+    else if (arg.rfind("--fuzz-stop=", 0) == 0) fuzzConfig.stopPC = value();
+    else if (arg.rfind("--fuzz-crash=", 0) == 0) fuzzConfig.crashPCs.push_back(value());
+    else if (arg.rfind("--fuzz-input=", 0) == 0) fuzzConfig.inputAddr = value();
+    else if (arg.rfind("--fuzz-max=", 0) == 0) fuzzConfig.maxInput = value();
+    else if (arg.rfind("--fuzz-length=", 0) == 0) fuzzConfig.lengthAddr = value();
+    else if (arg.rfind("--fuzz-cycles=", 0) == 0) fuzzConfig.maxCycles = std::stoull(arg.substr(14), nullptr, 0);
+    else if (arg.rfind("--fuzz-bench=", 0) == 0) fuzzConfig.bench = value();
+    else if (arg.rfind("--fuzz=", 0) == 0) fuzzConfig.inputs.push_back(arg.substr(7));
+    else return false;
+    return true;
+}
+
+struct Fuzzer
+{
+    enum class Result { Ok, Crash, Timeout };
+
+    // How long reaching the start PC from reset may take
+    static constexpr Cycles START_CYCLES = 100000000;
+
+    CPU6502* cpu;
+    Bus* bus;
+
+    uint64_t stops[0x10000 / 64] = {};
+    uint64_t crashes[0x10000 / 64] = {};
+    Result result = Result::Ok;
+
+    Snapshot snapshot;
+
+    // Bank registers are saved at the start PC when there's an MMU, the banks' contents are undone with the rest of memory
+    MMU* mmu = nullptr;
+
+    explicit Fuzzer(CPU6502* cpu, Bus* bus)
+    {
+        this->cpu = cpu;
+        this->bus = bus;
+    }
+
+    static void Set(uint64_t* bits, const Word addr)
+    {
+        bits[addr >> 6] |= 1ull << (addr & 63);
+    }
+
+    static bool Test(const uint64_t* bits, const Word addr)
+    {
+        return bits[addr >> 6] >> (addr & 63) & 1;
+    }
+
+    // Runs from wherever the CPU is to the start PC and snapshots there
+    bool Start()
+    {
+        Set(stops, fuzzConfig.startPC);
+        cpu->breakpoints = stops;
+        cpu->onBreakpoint = [this]()
+        {
+            result = Test(crashes, cpu->PC) ? Result::Crash : Result::Ok;
+            cpu->stop = true;
+        };
+        cpu->onIllegalOpcode = [this]()
+        {
+            result = Result::Crash;
+            cpu->stop = true;
+        };
+
+        cpu->Execute(START_CYCLES);
+        cpu->stop = false;
+        if (cpu->PC != fuzzConfig.startPC) return false;
+
+        // From here on the start PC is just another instruction
+        std::fill(std::begin(stops), std::end(stops), 0);
+        Set(stops, fuzzConfig.stopPC);
+        for (const Word pc : fuzzConfig.crashPCs)
+        {
+            Set(stops, pc);
+            Set(crashes, pc);
+        }
+
+        snapshot.Save(cpu, bus, mmu);
+        bus->SetDirtyTracking(true);
+        return true;
+    }
+
+    Result Run(const Byte* data, const size_t size)
+    {
+        const Word len = static_cast<Word>(std::min<size_t>(size, fuzzConfig.maxInput));
+        for (Word i = 0; i < len; i++)
+        {
+            bus->WriteByte(fuzzConfig.inputAddr + i, data[i]);
+        }
+        if (fuzzConfig.lengthAddr >= 0)
+        {
+            bus->WriteByte(fuzzConfig.lengthAddr, len & 0xFF);
+            bus->WriteByte(fuzzConfig.lengthAddr + 1, len >> 8);
+        }
+
+        // Every run's edges start from the same place, like a fresh process
+        if (cpu->coverage != nullptr) cpu->coverage->previous = 0;
+
+        result = Result::Timeout;
+        cpu->Execute(fuzzConfig.maxCycles);
+        cpu->stop = false;
+
+        const Result r = result;
+        Restore();
+        return r;
+    }
+
+    void Restore()
+    {
+        snapshot.RestoreCPU(cpu);
+        bus->UndoDirty();
+        snapshot.RestoreMMU(mmu);
+    }
+};
+
+#ifdef __AFL_FUZZ_TESTCASE_LEN
+__AFL_FUZZ_INIT();
+#endif
+
+// Runs the --fuzz inputs (or stdin), under afl-clang-fast it's an AFL++ persistent mode loop instead
+int RunFuzzer(Fuzzer* fuzzer)
+{
+    if (!fuzzer->Start())
+    {
+        std::cout << "Never reached the fuzzing start PC" << std::endl;
+        return 1;
+    }
+
+#ifdef __AFL_FUZZ_TESTCASE_LEN
+    __AFL_INIT();
+    const unsigned char* buf = __AFL_FUZZ_TESTCASE_BUF;
+    while (__AFL_LOOP(100000))
+    {
+        if (fuzzer->Run(buf, __AFL_FUZZ_TESTCASE_LEN) == Fuzzer::Result::Crash) abort();
+    }
+    return 0;
+#endif
+
+    // Random inputs, to see how many executions a second a target gets
+    if (fuzzConfig.bench > 0)
+    {
+        std::vector<Byte> input(fuzzConfig.maxInput);
+        uint32_t seed = 0x9E3779B9;
+        uint crashes = 0;
+        const auto start = std::chrono::steady_clock::now();
+        for (uint i = 0; i < fuzzConfig.bench; i++)
+        {
+            for (Byte& b : input)
+            {
+                seed ^= seed << 13;
+                seed ^= seed >> 17;
+                seed ^= seed << 5;
+                b = seed & 0xFF;
+            }
+            if (fuzzer->Run(input.data(), input.size()) == Fuzzer::Result::Crash) crashes++;
+        }
+        const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        std::cout << std::dec << fuzzConfig.bench << " runs, " << crashes << " crashes, " << std::lround(fuzzConfig.bench / seconds) << " execs/s" << std::endl;
+        return 0;
+    }
+
+    if (fuzzConfig.inputs.empty()) fuzzConfig.inputs.push_back("-");
+
+    bool crashed = false;
+    for (const std::string& path : fuzzConfig.inputs)
+    {
+        std::vector<Byte> input;
+        if (path == "-")
+        {
+            input.assign(std::istreambuf_iterator<char>(std::cin), std::istreambuf_iterator<char>());
+        }
+        else
+        {
+            std::ifstream f(path, std::ios::binary | std::ios::in);
+            input.assign(std::istreambuf_iterator<char>(f), std::istreambuf_iterator<char>());
+        }
+
+        const Fuzzer::Result r = fuzzer->Run(input.data(), input.size());
+        const char* names[] = { "ok", "crash", "timeout" };
+        std::cout << path << ": " << names[static_cast<int>(r)] << std::endl;
+        crashed |= r == Fuzzer::Result::Crash;
+    }
+    return crashed ? 1 : 0;
+}
+
+#ifdef LIBFUZZER
+// Build with clang++ -fsanitize=fuzzer -DLIBFUZZER, the --fuzz-* options go alongside libFuzzer's own
+Bus* fuzzBus;
+CPU6502* fuzzCpu;
+Fuzzer* fuzzer;
+
+extern "C" int LLVMFuzzerInitialize(int* argc, char*** argv)
+{
+    for (int i = 1; i < *argc; i++)
+    {
+        ParseFuzzOption((*argv)[i]);
+    }
+
+    Machine* machine = new Machine(512 * 1024);
+    fuzzBus = &machine->bus;
+    fuzzCpu = &machine->cpu;
+    fuzzCpu->coverage = new Coverage();
+
+    machine->Load("../program.bin");
+    fuzzCpu->Reset();
+
+    fuzzer = new Fuzzer(fuzzCpu, fuzzBus);
+    fuzzer->mmu = &machine->mmu;
+    if (!fuzzer->Start())
+    {
+        std::cout << "Never reached the fuzzing start PC" << std::endl;
+        exit(1);
+    }
+    return 0;
+}
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size)
+{
+    if (fuzzer->Run(data, size) == Fuzzer::Result::Crash) abort();
+    return 0;
+}
+#endif
+
+// Without debug info it's the address of every executed instruction, one (hex) a line
+// With it, an lcov tracefile where a line counts as hit if any of its bytes started an instruction
+bool WriteCoverage(const Coverage& coverage, const DebugInfo* debugInfo, const std::string& path)
+{
+    std::ofstream out(path);
+    if (!out.is_open()) return false;
+
+    if (debugInfo == nullptr)
+    {
+        out << std::hex << std::uppercase << std::setfill('0');
+        for (uint addr = 0; addr < 0x10000; addr++)
+        {
+            if (coverage.WasExecuted(addr)) out << std::setw(4) << addr << "\n";
+        }
+        return true;
+    }
+
+    for (size_t file = 0; file < debugInfo->files.size(); file++)
+    {
+        // A line can show up once per span list, keep the best result
+        std::map<int, bool> hits;
+        for (const DebugInfo::Line& line : debugInfo->lines)
+        {
+            if (line.file != static_cast<int>(file) || line.ranges.empty()) continue;
+
+            bool hit = false;
+            for (const DebugInfo::Range& range : line.ranges)
+            {
+                for (uint addr = range.start; addr < range.start + range.size && addr < 0x10000 && !hit; addr++)
+                {
+                    hit = coverage.WasExecuted(addr);
+                }
+            }
+            hits[line.line] |= hit;
+        }
+        if (hits.empty()) continue;
+
+        int found = 0;
+        out << "SF:" << debugInfo->files[file] << "\n";
+        for (const auto& [number, hit] : hits)
+        {
+            out << "DA:" << number << "," << hit << "\n";
+            found += hit;
+        }
+        out << "LH:" << found << "\nLF:" << hits.size() << "\nend_of_record\n";
+    }
+    return true;
+}
+
+// Watches the ROM image (--watch) and swaps a rebuilt one in without restarting, so the window and the debugger connection carry on
+// A host thread waits on inotify and reads the new image, the swap itself happens on the CPU thread at an instruction boundary
+// (checked once a frame), then the CPU is reset or, if one was taken (F5 or "monitor snapshot"), the snapshot is restored
+// The directory is watched rather than the file so images replaced by a rename are seen too
+struct RomReloader
+{
+    CPU6502* cpu;
+    Bus* bus;
+    std::string path;
+
+    int inotifyFd = -1;
+    std::thread watcher;
+    std::atomic<bool> closing{false};
+
+    // Handed from the watcher to the CPU thread
+    std::mutex lock;
+    std::vector<Byte> image;
+    std::chrono::steady_clock::time_point changed;
+    std::atomic<bool> ready{false};
+
+    // Restored instead of resetting when set, taken on the CPU thread
+    std::unique_ptr<Snapshot> snapshot;
+    std::atomic<bool> snapshotRequested{false};
+    // Its banks are part of the snapshot when set
+    MMU* mmu = nullptr;
+
+    int event = -1;
+
+    explicit RomReloader(CPU6502* cpu, Bus* bus)
+    {
+        this->cpu = cpu;
+        this->bus = bus;
+    }
+
+    ~RomReloader()
+    {
+        Close();
+    }
+
+    void Attach()
+    {
+        event = cpu->scheduler.Add([this](const Cycles now)
+        {
+            if (snapshotRequested.exchange(false)) TakeSnapshot();
+            if (ready) Swap();
+            cpu->scheduler.Schedule(event, now + CyclesPerFrame());
+        });
+        cpu->scheduler.Schedule(event, cpu->numCycles + CyclesPerFrame());
+    }
+
+    void TakeSnapshot()
+    {
+        if (snapshot == nullptr) snapshot.reset(new Snapshot());
+        snapshot->Save(cpu, bus, mmu);
+        std::cout << "Snapshot taken at " << std::hex << std::setw(4) << cpu->PC << std::endl;
+    }
+
+    void Swap()
+    {
+        std::chrono::steady_clock::time_point since;
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            bus->rom.Initialize();
+            bus->rom.Load(image);
+            since = changed;
+            ready = false;
+        }
+
+        if (snapshot != nullptr)
+        {
+            // Only RAM comes back, the ROM pages keep the new image
+            const Cycles now = cpu->numCycles;
+            snapshot->RestoreCPU(cpu);
+            snapshot->RestoreMMU(mmu);
+            for (int page = 0; page < Bus::NUM_PAGES; page++)
+            {
+                if (bus->memory[page] && bus->writable[page]) snapshot->RestorePage(bus, page);
+            }
+
+            // Time keeps going forward so frames and device events don't repeat, everything pending moves along with it
+            const Cycles shift = now - cpu->numCycles;
+            cpu->numCycles = now;
+            for (int i = 0; i < cpu->scheduler.numEvents; i++)
+            {
+                if (cpu->scheduler.events[i].when != Scheduler::NEVER) cpu->scheduler.events[i].when += shift;
+            }
+            cpu->scheduler.Update();
+        }
+        else
+        {
+            cpu->Reset();
+        }
+
+        const auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - since).count();
+        std::cout << "Reloaded " << path << " (" << std::dec << ms << " ms)" << std::endl;
+    }
+
+    // Reads the whole image, false if it's missing or too big for the ROM
+    bool Read(std::vector<Byte>& data) const
+    {
+        std::ifstream f(path, std::ios::binary);
+        if (!f.is_open()) return false;
+        data.assign(std::istreambuf_iterator<char>(f), std::istreambuf_iterator<char>());
+        return !data.empty() && data.size() <= ROM::MEM_SIZE;
+    }
+
+#ifdef __linux__
+    bool Open(const std::string& path)
+    {
+        this->path = path;
+        const size_t slash = path.rfind('/');
+        const std::string directory = slash == std::string::npos ? "." : path.substr(0, slash + 1);
+
+        inotifyFd = inotify_init1(IN_CLOEXEC);
+        if (inotifyFd < 0 || inotify_add_watch(inotifyFd, directory.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO) < 0) return false;
+
+        watcher = std::thread(&RomReloader::Watch, this);
+        return true;
+    }
+
+    void Watch()
+    {
+        const size_t slash = path.rfind('/');
+        const std::string name = slash == std::string::npos ? path : path.substr(slash + 1);
+        alignas(inotify_event) char buffer[4096];
+
+        while (!closing)
+        {
+            pollfd p = { inotifyFd, POLLIN, 0 };
+            if (poll(&p, 1, 50) <= 0) continue;
+
+            const ssize_t got = read(inotifyFd, buffer, sizeof(buffer));
+            bool changed = false;
+            for (ssize_t i = 0; i < got; )
+            {
+                const inotify_event* e = reinterpret_cast<const inotify_event*>(buffer + i);
+                if (e->len > 0 && name == e->name) changed = true;
+                i += sizeof(inotify_event) + e->len;
+            }
+            if (!changed) continue;
+
+            std::vector<Byte> data;
+            if (!Read(data))
+            {
+                std::cout << "Couldn't reload " << path << std::endl;
+                continue;
+            }
+
+            std::lock_guard<std::mutex> guard(lock);
+            image = std::move(data);
+            this->changed = std::chrono::steady_clock::now();
+            ready = true;
+        }
+    }
+
+    void Close()
+    {
+        if (!watcher.joinable()) return;
+
+        closing = true;
+        watcher.join();
+        close(inotifyFd);
+    }
+#else
+    bool Open(const std::string& path)
+    {
+        std::cout << "Watching the ROM needs inotify (Linux)" << std::endl;
+        return false;
+    }
+
+    void Close() {}
+#endif
+};
+
+// GDB remote serial protocol stub, listening on a local TCP port or a Unix socket
+// Registers are sent in the order A, X, Y, P, SP (a byte each), PC (little endian)
+// The protocol is handled on the CPU thread: it blocks in Stop() while stopped and checks for a break request once a frame while running
+struct Debugger
+{
+    CPU6502* cpu;
+    Bus* bus;
+
+    uint64_t breakpoints[0x10000 / 64] = {};
+
+    struct Watchpoint
+    {
+        Word addr;
+        Word len;
+        char type; // Z packet type: '2' write, '3' read, '4' access
+    };
+    std::vector<Watchpoint> watchpoints;
+
+    int listenFd = -1;
+    int fd = -1;
+    bool noAck = false;
+
+    int stopEvent = -1;
+    int pollEvent = -1;
+    std::string stopReply;
+
+    // For monitor commands when loaded
+    const DebugInfo* debugInfo = nullptr;
+    RomReloader* reloader = nullptr;
+
+    // Where the last stop was, so a breakpoint at the PC a step or watchpoint stopped on doesn't stop again
+    Cycles lastStopCycles = Scheduler::NEVER;
+
+    explicit Debugger(CPU6502* cpu, Bus* bus)
+    {
+        this->cpu = cpu;
+        this->bus = bus;
+    }
+
+#ifndef _WIN32
+    // where is a port number or unix:<path>, waits for GDB to connect
+    bool Listen(const std::string& where)
+    {
+        if (where.rfind("unix:", 0) == 0)
+        {
+            sockaddr_un addr = {};
+            addr.sun_family = AF_UNIX;
+            strncpy(addr.sun_path, where.c_str() + 5, sizeof(addr.sun_path) - 1);
+            unlink(addr.sun_path);
+
+            listenFd = socket(AF_UNIX, SOCK_STREAM, 0);
+            if (bind(listenFd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0) return false;
+        }
+        else
+        {
+            sockaddr_in addr = {};
+            addr.sin_family = AF_INET;
+            addr.sin_port = htons(std::stoi(where));
+            // Local connections only, there's no authentication
+            addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+            listenFd = socket(AF_INET, SOCK_STREAM, 0);
+            const int yes = 1;
+            setsockopt(listenFd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+            if (bind(listenFd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0) return false;
+        }
+
+        listen(listenFd, 1);
+        std::cout << "Waiting for GDB on " << where << std::endl;
+        fd = accept(listenFd, nullptr, nullptr);
+        if (fd < 0) return false;
+
+        const int yes = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+        return true;
+    }
+
+    void Close()
+    {
+        if (fd >= 0)
+        {
+            SendPacket("W00");
+            close(fd);
+        }
+        if (listenFd >= 0) close(listenFd);
+        fd = listenFd = -1;
+    }
+
+    int ReadChar()
+    {
+        Byte c;
+        return recv(fd, &c, 1, 0) == 1 ? c : -1;
+    }
+
+    void Send(const std::string& data)
+    {
+        send(fd, data.data(), data.size(), 0);
+    }
+
+    // Checks for a ^C from GDB without blocking
+    bool BreakRequested()
+    {
+        Byte c;
+        return recv(fd, &c, 1, MSG_DONTWAIT) == 1 && c == 0x03;
+    }
+#else
+    bool Listen(const std::string& where)
+    {
+        std::cout << "The GDB stub isn't supported on Windows" << std::endl;
+        return false;
+    }
+
+    void Close() {}
+    int ReadChar() { return -1; }
+    void Send(const std::string& data) {}
+    bool BreakRequested() { return false; }
+#endif
+
+    // Starts stopped at the current PC, like gdbserver
+    void Attach()
+    {
+        cpu->breakpoints = breakpoints;
+        cpu->onBreakpoint = [this]()
+        {
+            if (cpu->numCycles != lastStopCycles) Stop("T05");
+        };
+
+        bus->onWatch = [this](const Word addr, const bool write) { Watch(addr, write); };
+
+        stopEvent = cpu->scheduler.Add([this](Cycles) { Stop(stopReply); });
+        pollEvent = cpu->scheduler.Add([this](const Cycles now)
+        {
+            if (BreakRequested()) Stop("T02");
+            cpu->scheduler.Schedule(pollEvent, now + CyclesPerFrame());
+        });
+        cpu->scheduler.Schedule(pollEvent, cpu->numCycles + CyclesPerFrame());
+
+        Stop("");
+    }
+
+    // Stops at the next instruction boundary
+    void RequestStop(const std::string& reply)
+    {
+        stopReply = reply;
+        cpu->scheduler.Schedule(stopEvent, cpu->numCycles);
+    }
+
+    void Watch(const Word addr, const bool write)
+    {
+        for (const Watchpoint& w : watchpoints)
+        {
+            if (addr < w.addr || addr >= w.addr + w.len) continue;
+            if ((w.type == '2' && !write) || (w.type == '3' && write)) continue;
+
+            char reply[32];
+            snprintf(reply, sizeof(reply), "T05%s:%04x;", w.type == '2' ? "watch" : w.type == '3' ? "rwatch" : "awatch", addr);
+            RequestStop(reply);
+            return;
+        }
+    }
+
+    // Page flags are the union of every watchpoint touching the page
+    void UpdateWatchFlags()
+    {
+        Byte flags[Bus::NUM_PAGES] = {};
+        for (const Watchpoint& w : watchpoints)
+        {
+            for (int addr = w.addr & 0xFF00; addr < w.addr + w.len; addr += Bus::PAGE_SIZE)
+            {
+                flags[addr >> 8 & 0xFF] |= w.type == '2' ? Bus::WATCH_WRITE : w.type == '3' ? Bus::WATCH_READ : Bus::WATCH_READ | Bus::WATCH_WRITE;
+            }
+        }
+        for (int page = 0; page < Bus::NUM_PAGES; page++)
+        {
+            bus->SetWatch(page, flags[page]);
+        }
+    }
+
+    // Returns false if the client went away
+    bool ReadPacket(std::string& packet)
+    {
+        packet.clear();
+        int c;
+        while ((c = ReadChar()) != '$')
+        {
+            if (c < 0) return false;
+        }
+        while ((c = ReadChar()) != '#')
+        {
+            if (c < 0) return false;
+            packet += static_cast<char>(c);
+        }
+        ReadChar();
+        ReadChar();
+
+        if (!noAck) Send("+");
+        return true;
+    }
+
+    void SendPacket(const std::string& data)
+    {
+        Byte checksum = 0;
+        for (const char c : data) checksum += c;
+
+        char tail[4];
+        snprintf(tail, sizeof(tail), "#%02x", checksum);
+        Send("$" + data + tail);
+    }
+
+    static std::string Hex(const Byte b)
+    {
+        char s[3];
+        snprintf(s, sizeof(s), "%02x", b);
+        return s;
+    }
+
+    static Byte FromHex(const char* s)
+    {
+        return static_cast<Byte>(std::stoul(std::string(s, 2), nullptr, 16));
+    }
+
+    std::string Registers() const
+    {
+        return Hex(cpu->A) + Hex(cpu->X) + Hex(cpu->Y) + Hex(cpu->Status()) + Hex(cpu->SP) + Hex(cpu->PC & 0xFF) + Hex(cpu->PC >> 8);
+    }
+
+    void SetRegister(const int reg, const char* value)
+    {
+        switch (reg)
+        {
+            case 0: cpu->A = FromHex(value); break;
+            case 1: cpu->X = FromHex(value); break;
+            case 2: cpu->Y = FromHex(value); break;
+            case 3: cpu->SetStatus(FromHex(value)); break;
+            case 4: cpu->SP = FromHex(value); break;
+            case 5: cpu->PC = FromHex(value) | FromHex(value + 2) << 8; break;
+        }
+    }
+
+    // Handles packets until GDB continues or steps, reply is the stop reply for the reason we stopped
+    void Stop(const std::string& reply)
+    {
+        lastStopCycles = cpu->numCycles;
+        if (!reply.empty()) SendPacket(reply);
+
+        while (running)
+        {
+            std::string packet;
+            // Losing the client is a detach, only a k packet kills the machine
+            if (!ReadPacket(packet))
+            {
+                Detach();
+                return;
+            }
+            const char* args = packet.c_str() + 1;
+
+            switch (packet[0])
+            {
+                case '?':
+                    SendPacket("S05");
+                    break;
+                case 'g':
+                    SendPacket(Registers());
+                    break;
+                case 'G':
+                    for (int reg = 0; reg < 6; reg++) SetRegister(reg, args + reg * 2);
+                    SendPacket("OK");
+                    break;
+                case 'p':
+                {
+                    const int reg = std::stoi(args, nullptr, 16);
+                    const std::string regs = Registers();
+                    SendPacket(reg < 5 ? regs.substr(reg * 2, 2) : reg == 5 ? regs.substr(10, 4) : "E01");
+                    break;
+                }
+                case 'P':
+                    SetRegister(std::stoi(args, nullptr, 16), strchr(args, '=') + 1);
+                    SendPacket("OK");
+                    break;
+                case 'm':
+                {
+                    uint addr, len;
+                    sscanf(args, "%x,%x", &addr, &len);
+                    std::string data;
+                    for (uint i = 0; i < len; i++) data += Hex(bus->Peek(addr + i));
+                    SendPacket(data);
+                    break;
+                }
+                case 'M':
+                {
+                    uint addr, len;
+                    sscanf(args, "%x,%x", &addr, &len);
+                    const char* data = strchr(args, ':') + 1;
+                    for (uint i = 0; i < len; i++) bus->Poke(addr + i, FromHex(data + i * 2));
+                    SendPacket("OK");
+                    break;
+                }
+                case 'c':
+                case 's':
+                    if (*args != 0) cpu->PC = std::stoul(args, nullptr, 16);
+                    if (packet[0] == 's')
+                    {
+                        // Stop again at the next instruction boundary
+                        stopReply = "T05";
+                        cpu->scheduler.Schedule(stopEvent, cpu->numCycles + 1);
+                    }
+                    return;
+                case 'Z':
+                case 'z':
+                    SendPacket(SetPoint(packet[0] == 'Z', args) ? "OK" : "");
+                    break;
+                case 'k':
+                    running = false;
+                    return;
+                case 'D':
+                    SendPacket("OK");
+                    Detach();
+                    return;
+                case 'H':
+                    SendPacket("OK");
+                    break;
+                case 'q':
+                    if (packet.rfind("qSupported", 0) == 0) SendPacket("PacketSize=1000;QStartNoAckMode+");
+                    else if (packet == "qAttached") SendPacket("1");
+                    else if (packet == "qC") SendPacket("QC1");
+                    else if (packet == "qfThreadInfo") SendPacket("m1");
+                    else if (packet == "qsThreadInfo") SendPacket("l");
+                    else if (packet.rfind("qRcmd,", 0) == 0) Monitor(packet.substr(6));
+                    else SendPacket("");
+                    break;
+                case 'Q':
+                    if (packet == "QStartNoAckMode")
+                    {
+                        SendPacket("OK");
+                        noAck = true;
+                    }
+                    else SendPacket("");
+                    break;
+                default:
+                    SendPacket("");
+            }
+        }
+    }
+
+    // monitor where: the PC with its symbol and source line
+    // monitor info <addr>: the same for any address
+    // monitor addr <symbol>: looks up a symbol
+    // monitor exact on|off: switches every instruction to the cycle-exact core or back
+    // monitor snapshot [clear]: what a ROM reload restores instead of resetting
+    void Monitor(const std::string& hex)
+    {
+        std::string command;
+        for (size_t i = 0; i + 1 < hex.size(); i += 2) command += static_cast<char>(FromHex(hex.c_str() + i));
+
+        const auto describe = [this](const Word addr)
+        {
+            char s[8];
+            snprintf(s, sizeof(s), "%04x", addr);
+            std::string text = s;
+            if (debugInfo != nullptr)
+            {
+                text += " " + debugInfo->Symbolize(addr);
+                const std::string source = debugInfo->Source(addr);
+                if (!source.empty()) text += " (" + source + ")";
+            }
+            return text;
+        };
+
+        std::string reply;
+        Word addr;
+        if (command == "where")
+        {
+            reply = describe(cpu->PC);
+        }
+        else if (command.rfind("info ", 0) == 0)
+        {
+            reply = describe(static_cast<Word>(std::stoul(command.substr(5), nullptr, 16)));
+        }
+        else if (command.rfind("addr ", 0) == 0 && debugInfo != nullptr && debugInfo->FindAddress(command.substr(5), addr))
+        {
+            reply = describe(addr);
+        }
+        else if (command == "exact on" || command == "exact off")
+        {
+            cpu->exact = command == "exact on";
+            reply = cpu->exact ? "Cycle-exact core" : "Fast core";
+        }
+        else if (command == "snapshot" && reloader != nullptr)
+        {
+            reloader->TakeSnapshot();
+            reply = "Reloads restore this point";
+        }
+        else if (command == "snapshot clear" && reloader != nullptr)
+        {
+            reloader->snapshot.reset();
+            reply = "Reloads reset";
+        }
+        else
+        {
+            reply = "Unknown command or symbol";
+        }
+
+        // Console output goes in O packets
+        std::string output = "O";
+        for (const char c : reply + "\n") output += Hex(c);
+        SendPacket(output);
+        SendPacket("OK");
+    }
+
+    // Z/z type,addr,kind
+    bool SetPoint(const bool set, const char* args)
+    {
+        char type;
+        uint addr, len;
+        if (sscanf(args, "%c,%x,%x", &type, &addr, &len) != 3) return false;
+
+        if (type == '0' || type == '1')
+        {
+            if (set) breakpoints[addr >> 6 & 0x3FF] |= 1ull << (addr & 63);
+            else breakpoints[addr >> 6 & 0x3FF] &= ~(1ull << (addr & 63));
+            return true;
+        }
+        if (type < '2' || type > '4') return false;
+
+        for (size_t i = 0; i < watchpoints.size(); i++)
+        {
+            if (watchpoints[i].addr == addr && watchpoints[i].len == len && watchpoints[i].type == type)
+            {
+                watchpoints.erase(watchpoints.begin() + i);
+                break;
+            }
+        }
+        if (set) watchpoints.push_back({ static_cast<Word>(addr), static_cast<Word>(std::max(1u, len)), type });
+        UpdateWatchFlags();
+        return true;
+    }
+
+    // Back to full speed, nothing left checking for the debugger
+    void Detach()
+    {
+        cpu->breakpoints = nullptr;
+        watchpoints.clear();
+        UpdateWatchFlags();
+        cpu->scheduler.Cancel(stopEvent);
+        cpu->scheduler.Cancel(pollEvent);
+        Close();
+    }
+};
+
+struct Screen
+{
+    SDL_Texture* texture = nullptr;
+
+    // 3x5 font for on-screen readouts, one row per 3 bits with the top row in the high bits
+    static constexpr const char* FONT_CHARS = " 0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZ.:-/%";
+    static constexpr Word FONT[] = {
+        0x0000, 0x7B6F, 0x2C97, 0x73E7, 0x73CF, 0x5BC9, 0x79CF, 0x79EF,
+        0x7249, 0x7BEF, 0x7BCF, 0x2BED, 0x6BAE, 0x3923, 0x6B6E, 0x79A7,
+        0x79A4, 0x396B, 0x5BED, 0x7497, 0x126A, 0x5BAD, 0x4927, 0x5FED,
+        0x6B6D, 0x2B6A, 0x6BA4, 0x2B73, 0x6BAD, 0x388E, 0x7492, 0x5B6F,
+        0x5B6A, 0x5BFD, 0x5AAD, 0x5A92, 0x72A7, 0x0002, 0x0410, 0x01C0,
+        0x12A4, 0x52A5,
+    };
+    static constexpr int TEXT_SCALE = 3;
+
+    void Init()
+    {
+        texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_RGBA32, SDL_TEXTUREACCESS_STREAMING, videoMode.width, videoMode.height);
+    }
+
+    // Draws a whole RGBA8888 frame
+    void Draw(const uint32_t* frame)
+    {
+        SDL_UpdateTexture(texture, nullptr, frame, videoMode.width * sizeof(uint32_t));
+        const SDL_Rect dst = { 0, 0, videoMode.width, videoMode.height };
+        SDL_RenderCopy(renderer, texture, nullptr, &dst);
+    }
+
+    // Draws white text on a black box at (tx, ty) in window pixels / TEXT_SCALE
+    void DrawText(const int tx, const int ty, const char* text)
+    {
+        SDL_RenderSetScale(renderer, TEXT_SCALE, TEXT_SCALE);
+
+        const SDL_Rect box = { tx, ty, static_cast<int>(strlen(text)) * 4 + 1, 7 };
+        SDL_SetRenderDrawColor(renderer, 0, 0, 0, 255);
+        SDL_RenderFillRect(renderer, &box);
+
+        SDL_SetRenderDrawColor(renderer, 255, 255, 255, 255);
+        for (int i = 0; text[i] != 0; i++)
+        {
+            const char* c = strchr(FONT_CHARS, toupper(text[i]));
+            const Word glyph = c != nullptr ? FONT[c - FONT_CHARS] : 0;
+            for (int bit = 0; bit < 15; bit++)
+            {
+                if (glyph >> (14 - bit) & 1)
+                {
+                    SDL_RenderDrawPoint(renderer, tx + 1 + i * 4 + bit % 3, ty + 1 + bit / 3);
+                }
+            }
+        }
+
+        SDL_RenderSetScale(renderer, pixelScale, pixelScale);
+    }
+
+    void Present()
+    {
+        SDL_RenderPresent(renderer);
+    }
+};
+
+// Draws frames in the terminal instead of a window (--terminal[=<fps>]), for watching over SSH without SDL
+// Each character cell is two pixels stacked with the upper half block, the top pixel in the foreground colour and the
+// bottom one in the background, in 24-bit colour. Only cells that changed since the last frame are sent, cursor moves
+// and colours only when they aren't already right, and frames past the target rate are dropped before any work
+struct TerminalScreen
+{
+    // Top pixel << 32 | bottom pixel, as RGBA8888 (R in the low byte)
+    std::vector<uint64_t> cells;
+    int columns = 0;
+    int rows = 0;
+
+    float fps = 30;
+    std::chrono::steady_clock::time_point lastDraw;
+    bool first = true;
+
+    // Where the terminal's cursor is and what colours it has set while drawing a frame, -1 when unknown
+    int cursorX = -1;
+    int cursorY = -1;
+    int64_t fg = -1;
+    int64_t bg = -1;
+
+    std::string out;
+
+    void Init()
+    {
+        columns = videoMode.width;
+        rows = (videoMode.height + 1) / 2;
+#ifndef _WIN32
+        // Anything past the window's edge would wrap and scroll the rest, so only the top left that fits is drawn
+        struct winsize window;
+        if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &window) == 0 && window.ws_col > 0 && window.ws_row > 0)
+        {
+            if (window.ws_col < columns || window.ws_row < rows)
+            {
+                std::cerr << "Terminal is " << window.ws_col << "x" << window.ws_row << ", the screen needs " << columns << "x" << rows << " so it'll be cut off" << std::endl;
+            }
+            columns = std::min<int>(columns, window.ws_col);
+            rows = std::min<int>(rows, window.ws_row);
+        }
+#endif
+        cells.assign(columns * rows, 0);
+
+        // Alternate screen so the shell comes back as it was, no cursor
+        Write("\x1b[?1049h\x1b[?25l\x1b[2J");
+    }
+
+    // Whether a frame now would be within the rate
+    bool Due() const
+    {
+        return first || std::chrono::steady_clock::now() - lastDraw >= std::chrono::duration<float>(1.0f / fps);
+    }
+
+    void Draw(const uint32_t* frame)
+    {
+        if (!Due()) return;
+        lastDraw = std::chrono::steady_clock::now();
+
+        // Anything else printed since the last frame (the debugger, a device) has moved the cursor and maybe changed
+        // the colours, so they're only trusted within a frame
+        cursorX = cursorY = -1;
+        fg = bg = -1;
+
+        out.clear();
+        for (int y = 0; y < rows; y++)
+        {
+            const uint32_t* top = frame + y * 2 * videoMode.width;
+            const uint32_t* bottom = y * 2 + 1 < videoMode.height ? top + videoMode.width : nullptr;
+            for (int x = 0; x < columns; x++)
+            {
+                const uint64_t cell = static_cast<uint64_t>(top[x] & 0xFFFFFF) << 32 | (bottom != nullptr ? bottom[x] & 0xFFFFFF : 0);
+                uint64_t& last = cells[y * columns + x];
+                if (!first && cell == last) continue;
+                last = cell;
+
+                if (x != cursorX || y != cursorY)
+                {
+                    Append("\x1b[%d;%dH", y + 1, x + 1);
+                }
+                const int64_t upper = cell >> 32;
+                const int64_t lower = cell & 0xFFFFFF;
+                // A cell all one colour is a space, which only needs the background
+                if (upper == lower)
+                {
+                    Colour(48, bg, lower);
+                    out += ' ';
+                }
+                else
+                {
+                    Colour(38, fg, upper);
+                    Colour(48, bg, lower);
+                    out += "\xe2\x96\x80";
+                }
+                cursorX = x + 1;
+                cursorY = y;
+            }
+        }
+        first = false;
+        if (!out.empty()) Write(out);
+    }
+
+    // Sets the foreground (38) or background (48) colour if it isn't already
+    void Colour(const int which, int64_t& current, const int64_t rgba)
+    {
+        if (current == rgba) return;
+        current = rgba;
+        Append("\x1b[%d;2;%d;%d;%dm", which, static_cast<int>(rgba & 0xFF), static_cast<int>(rgba >> 8 & 0xFF), static_cast<int>(rgba >> 16 & 0xFF));
+    }
+
+    template <typename... Args>
+    void Append(const char* format, Args... args)
+    {
+        char s[32];
+        const int n = snprintf(s, sizeof(s), format, args...);
+        out.append(s, n);
+    }
+
+    void Write(const std::string& s)
+    {
+        fwrite(s.data(), 1, s.size(), stdout);
+        fflush(stdout);
+    }
+
+    void Close()
+    {
+        if (columns == 0) return;
+        Write("\x1b[0m\x1b[?25h\x1b[?1049l");
+        columns = 0;
+    }
+};
+
+#ifdef HEATMAP
+// Second window showing the whole address space as a 256x256 heatmap, one row per page
+// Red is writes, green reads and blue executes since the last update, fading out over a few frames
+struct HeatmapView
+{
+    static constexpr int SCALE = 2;
+
+    SDL_Window* window = nullptr;
+    SDL_Renderer* renderer = nullptr;
+    SDL_Texture* texture = nullptr;
+
+    const Heatmap* heatmap;
+    std::vector<uint32_t> last; // reads, writes, executes when last drawn
+    std::vector<Byte> heat; // per channel
+    std::vector<uint32_t> pixels;
+
+    explicit HeatmapView(const Heatmap* heatmap)
+    {
+        this->heatmap = heatmap;
+        last.resize(0x10000 * 3);
+        heat.resize(0x10000 * 3);
+        pixels.resize(0x10000);
+    }
+
+    void Init()
+    {
+        window = SDL_CreateWindow("Heatmap", SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED, 256 * SCALE, 256 * SCALE, 0);
+        renderer = SDL_CreateRenderer(window, -1, 0);
+        texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_RGBA32, SDL_TEXTUREACCESS_STREAMING, 256, 256);
+    }
+
+    void Close()
+    {
+        SDL_DestroyTexture(texture);
+        SDL_DestroyRenderer(renderer);
+        SDL_DestroyWindow(window);
+        window = nullptr;
+    }
+
+    void Update()
+    {
+        if (window == nullptr) return;
+
+        const uint32_t* counts[3] = { heatmap->writes, heatmap->reads, heatmap->executes };
+        for (int channel = 0; channel < 3; channel++)
+        {
+            for (int addr = 0; addr < 0x10000; addr++)
+            {
+                const int i = channel * 0x10000 + addr;
+                const uint32_t now = counts[channel][addr];
+                const uint32_t delta = now - last[i];
+                last[i] = now;
+
+                // Log scale, anything touched at all shows up
+                int level = 0;
+                if (delta != 0) level = std::min(255, 64 + 12 * (32 - __builtin_clz(delta)));
+                heat[i] = std::max(level, heat[i] * 7 / 8);
+            }
+        }
+
+        for (int addr = 0; addr < 0x10000; addr++)
+        {
+            pixels[addr] = heat[addr] | heat[0x10000 + addr] << 8 | heat[0x20000 + addr] << 16 | 0xFFu << 24;
+        }
+
+        SDL_UpdateTexture(texture, nullptr, pixels.data(), 256 * sizeof(uint32_t));
+        SDL_RenderCopy(renderer, texture, nullptr, nullptr);
+        SDL_RenderPresent(renderer);
+    }
+};
+#endif
+
+// Records frames to a Y4M or raw RGBA video, or a PNG sequence, on its own thread
+// Frames are copied into a pool of preallocated buffers, when none are free the frame is dropped instead of waiting on the disk
+struct VideoCapture
+{
+    enum class Format
+    {
+        Y4M,
+        Raw, // RGBA8888 frames back to back
+        PNG // One file per frame, path is a printf pattern (or gets _00000 added before the extension)
+    };
+
+    static constexpr uint POOL_SIZE = 16;
+
+    std::vector<uint32_t> buffers[POOL_SIZE];
+    SpscQueue<uint, POOL_SIZE> freeBuffers; // writer -> emulator
+    SpscQueue<uint, POOL_SIZE> fullBuffers; // emulator -> writer
+
+    std::string path;
+    Format format = Format::Y4M;
+    std::ofstream file;
+    std::thread writer;
+    std::atomic<bool> stopping{false};
+
+    uint captured = 0;
+    std::atomic<uint> written{0};
+    std::atomic<uint> dropped{0};
+
+    bool Start(const std::string& path)
+    {
+        this->path = path;
+        const std::string ext = path.substr(path.find_last_of('.') + 1);
+        format = ext == "png" ? Format::PNG : ext == "y4m" ? Format::Y4M : Format::Raw;
+
+        size_t start, end;
+        int width;
+        if (format == Format::PNG && path.find('%') != std::string::npos && !NumberField(path, start, end, width))
+        {
+            std::cout << "PNG capture paths can only have one %u (or %0<width>u) for the frame number" << std::endl;
+            return false;
+        }
+
+        if (format != Format::PNG)
+        {
+            file.open(path, std::ios::binary | std::ios::out);
+            if (!file.is_open())
+            {
+                std::cout << "Couldn't open " << path << " for capture" << std::endl;
+                return false;
+            }
+        }
+
+        if (format == Format::Y4M)
+        {
+            // Frame rate as a ratio so it doesn't need rounding
+            file << "YUV4MPEG2 W" << videoMode.width << " H" << videoMode.height << " F1000000:" << std::lround(FramePeriod() * 1000.0f) << " Ip A1:1 C444\n";
+        }
+
+        for (uint i = 0; i < POOL_SIZE; i++)
+        {
+            buffers[i].resize(videoMode.width * videoMode.height);
+            freeBuffers.Push(i);
+        }
+
+        writer = std::thread(&VideoCapture::Write, this);
+        return true;
+    }
+
+    // Called by whichever thread renders, never blocks
+    void Submit(const uint32_t* frame)
+    {
+        uint buffer;
+        if (!freeBuffers.Pop(buffer))
+        {
+            dropped++;
+            return;
+        }
+
+        memcpy(buffers[buffer].data(), frame, buffers[buffer].size() * sizeof(uint32_t));
+        fullBuffers.Push(buffer);
+        captured++;
+    }
+
+    // Writes out whatever's left and waits for the writer
+    void Stop()
+    {
+        if (!writer.joinable()) return;
+
+        stopping = true;
+        writer.join();
+        file.close();
+
+        std::cout << "Captured " << std::dec << written << " frames to " << path << " (" << dropped << " dropped)" << std::endl;
+    }
+
+    void Write()
+    {
+        std::vector<Byte> out;
+        uint frameNumber = 0;
+
+        while (true)
+        {
+            uint buffer;
+            if (!fullBuffers.Pop(buffer))
+            {
+                if (stopping) break;
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+                continue;
+            }
+
+            const std::vector<uint32_t>& frame = buffers[buffer];
+            switch (format)
+            {
+                case Format::Y4M:
+                    EncodeY4M(frame, out);
+                    file.write(reinterpret_cast<const char*>(out.data()), out.size());
+                    break;
+                case Format::Raw:
+                    file.write(reinterpret_cast<const char*>(frame.data()), frame.size() * sizeof(uint32_t));
+                    break;
+                case Format::PNG:
+                {
+                    EncodePNG(frame, out);
+                    std::ofstream png(FramePath(frameNumber), std::ios::binary | std::ios::out);
+                    png.write(reinterpret_cast<const char*>(out.data()), out.size());
+                    break;
+                }
+            }
+
+            freeBuffers.Push(buffer);
+            frameNumber++;
+            written++;
+        }
+    }
+
+    // Where the frame number goes in a path with one %u, %d or %0<width>u in it (the path is never a format string)
+    static bool NumberField(const std::string& path, size_t& start, size_t& end, int& width)
+    {
+        start = path.find('%');
+        if (start == std::string::npos) return false;
+
+        end = start + 1;
+        if (end < path.size() && path[end] == '0') end++;
+        width = 0;
+        while (end < path.size() && isdigit(static_cast<unsigned char>(path[end])))
+        {
+            width = std::min(width * 10 + (path[end++] - '0'), 32);
+        }
+        if (end == path.size() || (path[end] != 'u' && path[end] != 'd')) return false;
+        end++;
+        return path.find('%', end) == std::string::npos;
+    }
+
+    std::string FramePath(const uint frameNumber) const
+    {
+        size_t start, end;
+        int width;
+        if (NumberField(path, start, end, width))
+        {
+            std::string number = std::to_string(frameNumber);
+            if (static_cast<int>(number.size()) < width) number.insert(0, width - number.size(), '0');
+            return path.substr(0, start) + number + path.substr(end);
+        }
+
+        char name[1024];
+        const size_t dot = path.find_last_of('.');
+        snprintf(name, sizeof(name), "%s_%05u%s", path.substr(0, dot).c_str(), frameNumber, path.substr(dot).c_str());
+        return name;
+    }
+
+    // 4:4:4 BT.601 (studio swing), so no chroma subsampling to blur single pixels
+    static void EncodeY4M(const std::vector<uint32_t>& frame, std::vector<Byte>& out)
+    {
+        const size_t n = frame.size();
+        const char header[] = "FRAME\n";
+        out.resize(sizeof(header) - 1 + n * 3);
+        memcpy(out.data(), header, sizeof(header) - 1);
+
+        Byte* y = out.data() + sizeof(header) - 1;
+        Byte* u = y + n;
+        Byte* v = u + n;
+        for (size_t i = 0; i < n; i++)
+        {
+            const int r = frame[i] & 0xFF;
+            const int g = frame[i] >> 8 & 0xFF;
+            const int b = frame[i] >> 16 & 0xFF;
+            y[i] = ((66 * r + 129 * g + 25 * b + 128) >> 8) + 16;
+            u[i] = ((-38 * r - 74 * g + 112 * b + 128) >> 8) + 128;
+            v[i] = ((112 * r - 94 * g - 18 * b + 128) >> 8) + 128;
+        }
+    }
+
+    static uint Crc32(const Byte* data, const size_t len, uint crc = 0)
+    {
+        static uint table[256];
+        if (table[1] == 0)
+        {
+            for (uint i = 0; i < 256; i++)
+            {
+                uint c = i;
+                for (int k = 0; k < 8; k++) c = c & 1 ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+                table[i] = c;
+            }
+        }
+
+        crc = ~crc;
+        for (size_t i = 0; i < len; i++) crc = table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+        return ~crc;
+    }
+
+    static void PutBigEndian(std::vector<Byte>& out, const uint v)
+    {
+        out.push_back(v >> 24);
+        out.push_back(v >> 16);
+        out.push_back(v >> 8);
+        out.push_back(v);
+    }
+
+    static void PutChunk(std::vector<Byte>& out, const char* type, const std::vector<Byte>& data)
+    {
+        PutBigEndian(out, data.size());
+        const size_t start = out.size();
+        out.insert(out.end(), type, type + 4);
+        out.insert(out.end(), data.begin(), data.end());
+        PutBigEndian(out, Crc32(out.data() + start, out.size() - start));
+    }
+
+    // RGBA PNG with uncompressed (stored) deflate blocks, cheap to write and the frames are tiny anyway
+    static void EncodePNG(const std::vector<uint32_t>& frame, std::vector<Byte>& out)
+    {
+        const int w = videoMode.width;
+        const int h = videoMode.height;
+
+        // Each row gets filter type 0 in front
+        std::vector<Byte> raw;
+        raw.reserve(h * (w * 4 + 1));
+        for (int y = 0; y < h; y++)
+        {
+            raw.push_back(0);
+            const Byte* row = reinterpret_cast<const Byte*>(frame.data() + y * w);
+            raw.insert(raw.end(), row, row + w * 4);
+        }
+
+        std::vector<Byte> zlib = { 0x78, 0x01 };
+        for (size_t pos = 0; pos < raw.size() || pos == 0; )
+        {
+            const size_t len = std::min<size_t>(raw.size() - pos, 0xFFFF);
+            zlib.push_back(pos + len == raw.size());
+            zlib.push_back(len & 0xFF);
+            zlib.push_back(len >> 8);
+            zlib.push_back(~len & 0xFF);
+            zlib.push_back(~len >> 8 & 0xFF);
+            zlib.insert(zlib.end(), raw.begin() + pos, raw.begin() + pos + len);
+            pos += len;
+            if (len == 0) break;
+        }
+
+        uint a = 1, b = 0;
+        for (const Byte c : raw)
+        {
+            a = (a + c) % 65521;
+            b = (b + a) % 65521;
+        }
+        PutBigEndian(zlib, b << 16 | a);
+
+        out.clear();
+        const Byte signature[] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n' };
+        out.insert(out.end(), signature, signature + 8);
+
+        std::vector<Byte> ihdr;
+        PutBigEndian(ihdr, w);
+        PutBigEndian(ihdr, h);
+        ihdr.insert(ihdr.end(), { 8, 6, 0, 0, 0 }); // 8 bit RGBA, no interlacing
+        PutChunk(out, "IHDR", ihdr);
+        PutChunk(out, "IDAT", zlib);
+        PutChunk(out, "IEND", {});
+    }
+};
+
+// 64 bit xxHash (XXH64)
+uint64_t Hash64(const Byte* data, const size_t len, const uint64_t seed = 0)
+{
+    constexpr uint64_t P1 = 0x9E3779B185EBCA87ull;
+    constexpr uint64_t P2 = 0xC2B2AE3D27D4EB4Full;
+    constexpr uint64_t P3 = 0x165667B19E3779F9ull;
+    constexpr uint64_t P4 = 0x85EBCA77C2B2AE63ull;
+    constexpr uint64_t P5 = 0x27D4EB2F165667C5ull;
+
+    const auto rotl = [](const uint64_t x, const int r) { return x << r | x >> (64 - r); };
+    const auto round = [&](const uint64_t acc, const uint64_t input) { return rotl(acc + input * P2, 31) * P1; };
+    const auto read64 = [](const Byte* p) { uint64_t v; memcpy(&v, p, 8); return v; };
+    const auto read32 = [](const Byte* p) { uint32_t v; memcpy(&v, p, 4); return static_cast<uint64_t>(v); };
+
+    const Byte* p = data;
+    const Byte* end = data + len;
+    uint64_t h;
+
+    if (len >= 32)
+    {
+        uint64_t v[4] = { seed + P1 + P2, seed + P2, seed, seed - P1 };
+        for (; p + 32 <= end; p += 32)
+        {
+            for (int i = 0; i < 4; i++) v[i] = round(v[i], read64(p + i * 8));
+        }
+
+        h = rotl(v[0], 1) + rotl(v[1], 7) + rotl(v[2], 12) + rotl(v[3], 18);
+        for (int i = 0; i < 4; i++) h = (h ^ round(0, v[i])) * P1 + P4;
+    }
+    else
+    {
+        h = seed + P5;
+    }
+
+    h += len;
+    for (; p + 8 <= end; p += 8) h = rotl(h ^ round(0, read64(p)), 27) * P1 + P4;
+    if (p + 4 <= end)
+    {
+        h = rotl(h ^ read32(p) * P1, 23) * P2 + P3;
+        p += 4;
+    }
+    for (; p < end; p++) h = rotl(h ^ *p * P5, 11) * P1;
+
+    h ^= h >> 33;
+    h *= P2;
+    h ^= h >> 29;
+    h *= P3;
+    h ^= h >> 32;
+    return h;
+}
+
+// Hashes the visible part of the displayed framebuffer at every frame boundary for golden image tests
+// Writes "frame cycle hash" lines and/or checks them against a golden file written the same way
+struct FrameHasher
+{
+    Bus* bus;
+    const VideoControl* video;
+
+    std::ofstream out;
+    std::ifstream golden;
+    std::vector<Byte> visible;
+
+    uint frames = 0;
+    bool diverged = false;
+
+    explicit FrameHasher(Bus* bus, const VideoControl* video)
+    {
+        this->bus = bus;
+        this->video = video;
+        visible.resize(videoMode.width * videoMode.height);
+    }
+
+    bool Enabled() const
+    {
+        return out.is_open() || golden.is_open();
+    }
+
+    // Returns false once the run has diverged from the golden file
+    bool Frame(const Cycles cycle)
+    {
+        const Word base = video->DisplayBase();
+        for (int y = 0; y < videoMode.height; y++)
+        {
+            bus->Copy(visible.data() + y * videoMode.width, base + y * videoMode.stride, videoMode.width);
+        }
+        const uint64_t hash = Hash64(visible.data(), visible.size());
+
+        char line[64];
+        snprintf(line, sizeof(line), "%u %llu %016llx\n", frames, cycle, static_cast<unsigned long long>(hash));
+        if (out.is_open())
+        {
+            out << line;
+        }
+
+        if (golden.is_open())
+        {
+            uint goldenFrame;
+            Cycles goldenCycle;
+            uint64_t goldenHash;
+            if (!(golden >> std::dec >> goldenFrame >> goldenCycle >> std::hex >> goldenHash))
+            {
+                std::cout << "Golden file ends at frame " << std::dec << frames << " but the run goes on" << std::endl;
+                golden.close();
+                diverged = true;
+            }
+            else if (goldenCycle != cycle || goldenHash != hash)
+            {
+                std::cout << "First diverging frame: " << std::dec << frames << std::endl;
+                std::cout << "  expected cycle " << goldenCycle << " hash " << std::hex << std::setw(16) << goldenHash << std::endl;
+                std::cout << "  got      cycle " << std::dec << cycle << " hash " << std::hex << std::setw(16) << hash << std::endl;
+                diverged = true;
+            }
+        }
+
+        frames++;
+        return !diverged;
+    }
+
+    // A run that stops short of the golden file hasn't matched it either, returns false if so
+    bool Finish()
+    {
+        if (!golden.is_open() || diverged) return !diverged;
+
+        uint goldenFrame;
+        if (golden >> std::dec >> goldenFrame)
+        {
+            std::cout << "Run ends at frame " << std::dec << frames << " but the golden file goes on" << std::endl;
+            diverged = true;
+        }
+        return !diverged;
+    }
+};
+
+// Performance counters, optionally in shared memory (--telemetry=<name> for shm_open) so an external tool can map them
+// The CPU thread counts with plain variables and publishes about every 20ms of host time, the GPU thread once per frame,
+// so nothing atomic happens per instruction. Readers should check magic and version, rates are over about half a second
+struct TelemetryBlock
+{
+    static constexpr uint32_t MAGIC = 0x4D4C4554; // "TELM"
+    static constexpr uint32_t VERSION = 1;
+    // Bucket 0 is under 1ms, bucket i is [2^(i-1), 2^i) ms and the last one takes everything longer
+    static constexpr int FRAME_BUCKETS = 16;
+
+    uint32_t magic = MAGIC;
+    uint32_t version = VERSION;
+
+    // CPU thread
+    std::atomic<uint64_t> cycles{0};
+    std::atomic<uint64_t> instructions{0};
+    std::atomic<uint64_t> irqs{0};
+    std::atomic<uint64_t> nmis{0};
+    std::atomic<uint64_t> pacingNs{0}; // Sleeping in Clock() (or between lockstep frames)
+    std::atomic<double> mhz{0};
+    std::atomic<double> instructionsPerSecond{0};
+    std::atomic<double> irqsPerSecond{0};
+    std::atomic<double> pacingFraction{0}; // Of host time
+
+    // GPU thread
+    std::atomic<uint64_t> framesPresented{0};
+    std::atomic<uint64_t> framesSkipped{0}; // By turbo
+    std::atomic<uint64_t> framesDropped{0}; // Frame periods that passed without a frame
+    std::atomic<uint64_t> captureDropped{0};
+    std::atomic<uint64_t> frameTimes[FRAME_BUCKETS] = {};
+};
+
+static_assert(std::atomic<uint64_t>::is_always_lock_free && std::atomic<double>::is_always_lock_free, "Telemetry needs lock-free atomics to be shared");
+
+struct Telemetry
+{
+    TelemetryBlock* block = nullptr;
+    std::string name;
+
+    CPU6502* cpu = nullptr;
+    int event = -1;
+
+    // Start of the current rate window
+    std::chrono::steady_clock::time_point windowStart;
+    Cycles windowCycles = 0;
+    uint64_t windowInstructions = 0;
+    uint64_t windowIrqs = 0;
+    uint64_t windowPacingNs = 0;
+
+    // Publishes aim for a fixed host time apart, since a frame can be very few cycles (100 at the
+    // default clock) or very many host frames short in turbo. The interval in cycles follows the speed
+    static constexpr double PUBLISH_SECONDS = 0.02;
+    Cycles interval = 0;
+    std::chrono::steady_clock::time_point lastPublish;
+    Cycles lastPublishCycles = 0;
+
+    std::chrono::steady_clock::time_point lastFrame;
+    bool firstFrame = true;
+
+#ifndef _WIN32
+    // Shared if there's a name, otherwise just for the overlay
+    bool Open(const std::string& name)
+    {
+        if (name.empty())
+        {
+            block = new TelemetryBlock();
+            return true;
+        }
+
+        const std::string shmName = name[0] == '/' ? name : "/" + name;
+        const int fd = shm_open(shmName.c_str(), O_CREAT | O_RDWR, 0644);
+        if (fd < 0) return false;
+        if (ftruncate(fd, sizeof(TelemetryBlock)) != 0)
+        {
+            close(fd);
+            return false;
+        }
+
+        void* p = mmap(nullptr, sizeof(TelemetryBlock), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+        if (p == MAP_FAILED) return false;
+
+        block = new (p) TelemetryBlock();
+        this->name = shmName;
+        return true;
+    }
+
+    void Close()
+    {
+        if (block == nullptr) return;
+
+        if (name.empty())
+        {
+            delete block;
+        }
+        else
+        {
+            munmap(block, sizeof(TelemetryBlock));
+            shm_unlink(name.c_str());
+        }
+        block = nullptr;
+    }
+#else
+    bool Open(const std::string& name)
+    {
+        if (!name.empty())
+        {
+            std::cout << "Shared telemetry isn't supported on Windows" << std::endl;
+            return false;
+        }
+        block = new TelemetryBlock();
+        return true;
+    }
+
+    void Close()
+    {
+        delete block;
+        block = nullptr;
+    }
+#endif
+
+    void Attach(CPU6502* cpu)
+    {
+        this->cpu = cpu;
+        windowStart = std::chrono::steady_clock::now();
+        windowCycles = cpu->numCycles;
+        lastPublish = windowStart;
+        lastPublishCycles = cpu->numCycles;
+        interval = CyclesPerFrame();
+        event = cpu->scheduler.Add([this](const Cycles now) { Publish(now); });
+        cpu->scheduler.Schedule(event, cpu->numCycles + interval);
+    }
+
+    // CPU thread
+    void Publish(const Cycles now)
+    {
+        const auto time = std::chrono::steady_clock::now();
+        const double elapsed = std::chrono::duration<double>(time - lastPublish).count();
+        if (elapsed > 0)
+        {
+            // Grow at most 4x at a time so one long pause (a breakpoint, a slow frame) can't stretch it too far
+            const double target = (now - lastPublishCycles) * PUBLISH_SECONDS / elapsed;
+            interval = std::max(CyclesPerFrame(), std::min(static_cast<Cycles>(target), interval * 4));
+        }
+        lastPublish = time;
+        lastPublishCycles = now;
+        cpu->scheduler.Schedule(event, now + interval);
+
+        block->cycles.store(now, std::memory_order_relaxed);
+        block->instructions.store(cpu->instructions, std::memory_order_relaxed);
+        block->irqs.store(cpu->irqs, std::memory_order_relaxed);
+        block->nmis.store(cpu->nmis, std::memory_order_relaxed);
+        block->pacingNs.store(cpu->pacingNs, std::memory_order_relaxed);
+
+        const double seconds = std::chrono::duration<double>(time - windowStart).count();
+        if (seconds < 0.5) return;
+
+        block->mhz.store((now - windowCycles) / seconds / 1000000.0, std::memory_order_relaxed);
+        block->instructionsPerSecond.store((cpu->instructions - windowInstructions) / seconds, std::memory_order_relaxed);
+        block->irqsPerSecond.store((cpu->irqs + cpu->nmis - windowIrqs) / seconds, std::memory_order_relaxed);
+        block->pacingFraction.store((cpu->pacingNs - windowPacingNs) / (seconds * 1e9), std::memory_order_relaxed);
+
+        windowStart = time;
+        windowCycles = now;
+        windowInstructions = cpu->instructions;
+        windowIrqs = cpu->irqs + cpu->nmis;
+        windowPacingNs = cpu->pacingNs;
+    }
+
+    // GPU thread, after every call to GPU::Frame
+    void Frame(const bool presented, const uint captureDropped)
+    {
+        block->captureDropped.store(captureDropped, std::memory_order_relaxed);
+        if (!presented)
+        {
+            block->framesSkipped.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        block->framesPresented.fetch_add(1, std::memory_order_relaxed);
+
+        const auto time = std::chrono::steady_clock::now();
+        if (firstFrame)
+        {
+            firstFrame = false;
+            lastFrame = time;
+            return;
+        }
+
+        const double ms = std::chrono::duration<double, std::milli>(time - lastFrame).count();
+        lastFrame = time;
+
+        int bucket = 0;
+        while (bucket < TelemetryBlock::FRAME_BUCKETS - 1 && ms >= (1 << bucket)) bucket++;
+        block->frameTimes[bucket].fetch_add(1, std::memory_order_relaxed);
+
+        // Turbo doesn't try to keep up with real time
+        if (!turbo && ms > FramePeriod() * 1.5f)
+        {
+            block->framesDropped.fetch_add(static_cast<uint64_t>(std::lround(ms / FramePeriod())) - 1, std::memory_order_relaxed);
+        }
+    }
+};
+
+struct GPU
+{
+    Bus* bus;
+    const CPU6502* cpu;
+    const VideoControl* video;
+
+    Screen* screen;
+    VideoCapture* capture = nullptr;
+    TerminalScreen* terminal = nullptr;
+    Telemetry* telemetry = nullptr;
+    bool showTelemetry = false;
+    RomReloader* reloader = nullptr;
+    Keyboard* keyboard = nullptr;
+
+#ifdef HEATMAP
+    HeatmapView heatmapView;
+#endif
+
+    // One row of VRAM and the converted RGBA frame
+    std::vector<Byte> row;
+    std::vector<uint32_t> frame;
+
+    // Emulated frame last shown and when (ms), used to skip frames in turbo
+    Cycles lastPresentFrame = 0;
+    Uint32 lastPresentTime = 0;
+
+    // Speed readout: emulated clock rate relative to the nominal 1 / clockTime rate
+    Cycles lastSampleCycles = 0;
+    Uint32 lastSampleTime = 0;
+    float speed = 0;
+
+    explicit GPU(Bus* bus, Screen* screen, const CPU6502* cpu, const VideoControl* video)
+#ifdef HEATMAP
+        : heatmapView(&cpu->heatmap)
+#endif
+    {
+        this->bus = bus;
+        this->screen = screen;
+        this->cpu = cpu;
+        this->video = video;
+
+        row.resize(videoMode.width);
+        frame.resize(videoMode.width * videoMode.height);
+    }
+
+    void Init()
+    {
+        if (headless) return;
+
+        SDL_Init(SDL_INIT_EVERYTHING);
+        window = SDL_CreateWindow("6502 Computer", SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED, videoMode.width*pixelScale, videoMode.height*pixelScale, 0);
+        // Lockstep presents once per emulated frame, so it can wait on vsync instead of tearing
+        renderer = SDL_CreateRenderer(window, -1, lockstep ? SDL_RENDERER_PRESENTVSYNC : 0);
+        SDL_RenderSetScale(renderer, pixelScale, pixelScale);
+        screen->Init();
+
+#ifdef HEATMAP
+        heatmapView.Init();
+#endif
+    }
+
+    void PollEvents()
+    {
+        if (headless) return;
+
+        while(SDL_PollEvent(&e))
+        {
+            if (e.type == SDL_QUIT)
+            {
+                running = false;
+            }
+            if (e.type == SDL_WINDOWEVENT && e.window.event == SDL_WINDOWEVENT_CLOSE)
+            {
+#ifdef HEATMAP
+                // Closing the heatmap just closes the heatmap
+                if (heatmapView.window != nullptr && e.window.windowID == SDL_GetWindowID(heatmapView.window))
+                {
+                    heatmapView.Close();
+                    continue;
+                }
+#endif
+                running = false;
+            }
+            if (e.type == SDL_KEYDOWN && e.key.repeat == 0 && e.key.keysym.sym == SDLK_TAB)
+            {
+                turbo = !turbo;
+            }
+            // Snapshot for ROM reloads to come back to
+            else if (e.type == SDL_KEYDOWN && e.key.repeat == 0 && e.key.keysym.sym == SDLK_F5 && reloader != nullptr)
+            {
+                reloader->snapshotRequested = true;
+            }
+            // TAB and F5 belong to the emulator, every other key goes to the machine
+            else if ((e.type == SDL_KEYDOWN || e.type == SDL_KEYUP) && keyboard != nullptr && e.key.keysym.sym != SDLK_TAB && e.key.keysym.sym != SDLK_F5)
+            {
+                keyboard->Key(e.key.keysym.scancode, e.type == SDL_KEYUP);
+            }
+        }
+    }
+
+    void RenderFrame()
+    {
+        // Nothing to show it on
+        if (headless && capture == nullptr && (terminal == nullptr || !terminal->Due())) return;
+
+        // By default the first 3 bits are 011 to address the vram through the bus correctly, next 6 bits of addr are y val, last 7 are x val
+        // color is stored in a byte: 2 bits for each color -> 64 colors (or a palette index)
+        const Word base = video->DisplayBase();
+        for (int y = 0; y < videoMode.height; y++)
+        {
+            bus->Copy(row.data(), base + y * videoMode.stride, videoMode.width);
+            ConvertPixels(row.data(), frame.data() + y * videoMode.width, videoMode.width, video->Lut(), video->format);
+        }
+
+        if (capture != nullptr)
+        {
+            capture->Submit(frame.data());
+        }
+        if (terminal != nullptr)
+        {
+            terminal->Draw(frame.data());
+        }
+    }
+
+    void UpdateSpeed(const Uint32 now)
+    {
+        if (now - lastSampleTime < 500) return;
+
+        const Cycles cycles = cpu->numCycles;
+        const float cyclesPerSecond = (cycles - lastSampleCycles) * 1000.0f / (now - lastSampleTime);
+        speed = cyclesPerSecond * clockTime / 1000.0f;
+
+        lastSampleCycles = cycles;
+        lastSampleTime = now;
+    }
+
+    // Readouts under the turbo speed, with --telemetry-overlay
+    void DrawTelemetry()
+    {
+        if (!showTelemetry || telemetry == nullptr) return;
+
+        const TelemetryBlock* t = telemetry->block;
+        char line[32];
+        snprintf(line, sizeof(line), "%.3fMHZ", t->mhz.load(std::memory_order_relaxed));
+        screen->DrawText(1, 9, line);
+        snprintf(line, sizeof(line), "%.0fK IPS", t->instructionsPerSecond.load(std::memory_order_relaxed) / 1000.0);
+        screen->DrawText(1, 17, line);
+        snprintf(line, sizeof(line), "%.0f IRQ/S", t->irqsPerSecond.load(std::memory_order_relaxed));
+        screen->DrawText(1, 25, line);
+        snprintf(line, sizeof(line), "%llu DROP", static_cast<unsigned long long>(t->framesDropped.load(std::memory_order_relaxed)));
+        screen->DrawText(1, 33, line);
+        snprintf(line, sizeof(line), "%.0f%% PACE", t->pacingFraction.load(std::memory_order_relaxed) * 100.0);
+        screen->DrawText(1, 41, line);
+    }
+
+    // Draws and presents the current frame, returns false if it was skipped by turbo
+    bool Frame()
+    {
+        const bool presented = DrawFrame();
+        if (telemetry != nullptr)
+        {
+            telemetry->Frame(presented, capture != nullptr ? capture->dropped.load() : 0);
+        }
+        return presented;
+    }
+
+    bool DrawFrame()
+    {
+        const Uint32 now = SDL_GetTicks();
+        UpdateSpeed(now);
+
+#ifdef HEATMAP
+        if (!headless)
+        {
+            heatmapView.Update();
+        }
+#endif
+
+        if (!turbo)
+        {
+            RenderFrame();
+            if (!headless)
+            {
+                screen->Draw(frame.data());
+                DrawTelemetry();
+                screen->Present();
+            }
+            return true;
+        }
+
+        // Only render when enough emulated frames or host time have passed
+        const Cycles frameNumber = cpu->numCycles / CyclesPerFrame();
+        if (frameNumber - lastPresentFrame < static_cast<Cycles>(turboFrameSkip) && now - lastPresentTime < 1000.0f / turboPresentRate)
+        {
+            return false;
+        }
+        lastPresentFrame = frameNumber;
+        lastPresentTime = now;
+
+        RenderFrame();
+        if (headless) return true;
+
+        screen->Draw(frame.data());
+        char readout[16];
+        snprintf(readout, sizeof(readout), "%.1fX", speed);
+        screen->DrawText(1, 1, readout);
+        DrawTelemetry();
+        screen->Present();
+        return true;
+    }
+
+    void Run()
+    {
+        Init();
+
+        while (running)
+        {
+            PollEvents();
+
+            if (!Frame())
+            {
+                // Skipped, just keep polling
+                SDL_Delay(1);
+            }
+            else if (!turbo)
+            {
+                SDL_Delay(FramePeriod());
+            }
+        }
+    }
+};
+
+// Static analysis (--analyze): disassembles the ROM from the reset, NMI and IRQ vectors along every path, splits it into
+// routines (the vectors and every JSR target) and works out the fewest and most cycles each takes from entry to its
+// RTS/RTI with CPU6502::CYCLES, the table the fast core clocks with
+// Branch targets are known so taken branches are costed exactly, page crossings on indexed reads only count in the maximum
+// Loops, recursion and indirect jumps leave the maximum unbounded. --budget=<routine>:<cycles> flags routines whose
+// worst case can go over, with the path that does it (routine is reset/irq/nmi, a symbol or a hex address)
+struct Analyzer
+{
+    enum class Mode : Byte { Implied, Accumulator, Immediate, ZeroPage, ZeroPageX, ZeroPageY, Absolute, AbsoluteX, AbsoluteY, Indirect, IndirectX, IndirectY, Relative };
+
+    struct Opcode
+    {
+        const char* name = nullptr;
+        Mode mode = Mode::Implied;
+    };
+
+    struct Instruction
+    {
+        Byte op;
+        Word operand;
+        Byte size;
+    };
+
+    static constexpr Cycles UNBOUNDED = Scheduler::NEVER;
+
+    struct Routine
+    {
+        std::string name;
+        std::vector<Word> body;
+        bool computed = false;
+        bool computing = false;
+        bool returns = false;
+        Cycles min = 0;
+        Cycles max = 0;
+        std::string unbounded; // Why max is unbounded
+        std::vector<Word> worst; // Instructions along the longest path
+    };
+
+    // Where an instruction can go and what it costs to go there, to == EXIT for RTS/RTI
+    struct Edge
+    {
+        int to;
+        Cycles min;
+        Cycles max;
+    };
+    static constexpr int EXIT = 0x10000;
+
+    const Bus* bus;
+    const DebugInfo* debugInfo;
+
+    Opcode opcodes[256];
+    std::map<Word, Instruction> code;
+    std::map<Word, Routine> routines;
+    Word vectors[3];
+
+    explicit Analyzer(const Bus* bus, const DebugInfo* debugInfo)
+    {
+        this->bus = bus;
+        this->debugInfo = debugInfo;
+
+        static const struct { Byte code; const char* name; Mode mode; } OPCODES[] = {
+            { 0x00, "BRK", Mode::Implied }, { 0x01, "ORA", Mode::IndirectX }, { 0x05, "ORA", Mode::ZeroPage },
+            { 0x06, "ASL", Mode::ZeroPage }, { 0x08, "PHP", Mode::Implied }, { 0x09, "ORA", Mode::Immediate },
+            { 0x0A, "ASL", Mode::Accumulator }, { 0x0D, "ORA", Mode::Absolute }, { 0x0E, "ASL", Mode::Absolute },
+            { 0x10, "BPL", Mode::Relative }, { 0x11, "ORA", Mode::IndirectY }, { 0x15, "ORA", Mode::ZeroPageX },
+            { 0x16, "ASL", Mode::ZeroPageX }, { 0x18, "CLC", Mode::Implied }, { 0x19, "ORA", Mode::AbsoluteY },
+            { 0x1D, "ORA", Mode::AbsoluteX }, { 0x1E, "ASL", Mode::AbsoluteX }, { 0x20, "JSR", Mode::Absolute },
+            { 0x21, "AND", Mode::IndirectX }, { 0x24, "BIT", Mode::ZeroPage }, { 0x25, "AND", Mode::ZeroPage },
+            { 0x26, "ROL", Mode::ZeroPage }, { 0x28, "PLP", Mode::Implied }, { 0x29, "AND", Mode::Immediate },
+            { 0x2A, "ROL", Mode::Accumulator }, { 0x2C, "BIT", Mode::Absolute }, { 0x2D, "AND", Mode::Absolute },
+            { 0x2E, "ROL", Mode::Absolute }, { 0x30, "BMI", Mode::Relative }, { 0x31, "AND", Mode::IndirectY },
+            { 0x35, "AND", Mode::ZeroPageX }, { 0x36, "ROL", Mode::ZeroPageX }, { 0x38, "SEC", Mode::Implied },
+            { 0x39, "AND", Mode::AbsoluteY }, { 0x3D, "AND", Mode::AbsoluteX }, { 0x3E, "ROL", Mode::AbsoluteX },
+            { 0x40, "RTI", Mode::Implied }, { 0x41, "EOR", Mode::IndirectX }, { 0x45, "EOR", Mode::ZeroPage },
+            { 0x46, "LSR", Mode::ZeroPage }, { 0x48, "PHA", Mode::Implied }, { 0x49, "EOR", Mode::Immediate },
+            { 0x4A, "LSR", Mode::Accumulator }, { 0x4C, "JMP", Mode::Absolute }, { 0x4D, "EOR", Mode::Absolute },
+            { 0x4E, "LSR", Mode::Absolute }, { 0x50, "BVC", Mode::Relative }, { 0x51, "EOR", Mode::IndirectY },
+            { 0x55, "EOR", Mode::ZeroPageX }, { 0x56, "LSR", Mode::ZeroPageX }, { 0x58, "CLI", Mode::Implied },
+            { 0x59, "EOR", Mode::AbsoluteY }, { 0x5D, "EOR", Mode::AbsoluteX }, { 0x5E, "LSR", Mode::AbsoluteX },
+            { 0x60, "RTS", Mode::Implied }, { 0x61, "ADC", Mode::IndirectX }, { 0x65, "ADC", Mode::ZeroPage },
+            { 0x66, "ROR", Mode::ZeroPage }, { 0x68, "PLA", Mode::Implied }, { 0x69, "ADC", Mode::Immediate },
+            { 0x6A, "ROR", Mode::Accumulator }, { 0x6C, "JMP", Mode::Indirect }, { 0x6D, "ADC", Mode::Absolute },
+            { 0x6E, "ROR", Mode::Absolute }, { 0x70, "BVS", Mode::Relative }, { 0x71, "ADC", Mode::IndirectY },
+            { 0x75, "ADC", Mode::ZeroPageX }, { 0x76, "ROR", Mode::ZeroPageX }, { 0x78, "SEI", Mode::Implied },
+            { 0x79, "ADC", Mode::AbsoluteY }, { 0x7D, "ADC", Mode::AbsoluteX }, { 0x7E, "ROR", Mode::AbsoluteX },
+            { 0x81, "STA", Mode::IndirectX }, { 0x84, "STY", Mode::ZeroPage }, { 0x85, "STA", Mode::ZeroPage },
+            { 0x86, "STX", Mode::ZeroPage }, { 0x88, "DEY", Mode::Implied }, { 0x8A, "TXA", Mode::Implied },
+            { 0x8C, "STY", Mode::Absolute }, { 0x8D, "STA", Mode::Absolute }, { 0x8E, "STX", Mode::Absolute },
+            { 0x90, "BCC", Mode::Relative }, { 0x91, "STA", Mode::IndirectY }, { 0x94, "STY", Mode::ZeroPageX },
+            { 0x95, "STA", Mode::ZeroPageX }, { 0x96, "STX", Mode::ZeroPageY }, { 0x98, "TYA", Mode::Implied },
+            { 0x99, "STA", Mode::AbsoluteY }, { 0x9A, "TXS", Mode::Implied }, { 0x9D, "STA", Mode::AbsoluteX },
+            { 0xA0, "LDY", Mode::Immediate }, { 0xA1, "LDA", Mode::IndirectX }, { 0xA2, "LDX", Mode::Immediate },
+            { 0xA4, "LDY", Mode::ZeroPage }, { 0xA5, "LDA", Mode::ZeroPage }, { 0xA6, "LDX", Mode::ZeroPage },
+            { 0xA8, "TAY", Mode::Implied }, { 0xA9, "LDA", Mode::Immediate }, { 0xAA, "TAX", Mode::Implied },
+            { 0xAC, "LDY", Mode::Absolute }, { 0xAD, "LDA", Mode::Absolute }, { 0xAE, "LDX", Mode::Absolute },
+            { 0xB0, "BCS", Mode::Relative }, { 0xB1, "LDA", Mode::IndirectY }, { 0xB4, "LDY", Mode::ZeroPageX },
+            { 0xB5, "LDA", Mode::ZeroPageX }, { 0xB6, "LDX", Mode::ZeroPageY }, { 0xB8, "CLV", Mode::Implied },
+            { 0xB9, "LDA", Mode::AbsoluteY }, { 0xBA, "TSX", Mode::Implied }, { 0xBC, "LDY", Mode::AbsoluteX },
+            { 0xBD, "LDA", Mode::AbsoluteX }, { 0xBE, "LDX", Mode::AbsoluteY }, { 0xC0, "CPY", Mode::Immediate },
+            { 0xC1, "CMP", Mode::IndirectX }, { 0xC4, "CPY", Mode::ZeroPage }, { 0xC5, "CMP", Mode::ZeroPage },
+            { 0xC6, "DEC", Mode::ZeroPage }, { 0xC8, "INY", Mode::Implied }, { 0xC9, "CMP", Mode::Immediate },
+            { 0xCA, "DEX", Mode::Implied }, { 0xCC, "CPY", Mode::Absolute }, { 0xCD, "CMP", Mode::Absolute },
+            { 0xCE, "DEC", Mode::Absolute }, { 0xD0, "BNE", Mode::Relative }, { 0xD1, "CMP", Mode::IndirectY },
+            { 0xD5, "CMP", Mode::ZeroPageX }, { 0xD6, "DEC", Mode::ZeroPageX }, { 0xD8, "CLD", Mode::Implied },
+            { 0xD9, "CMP", Mode::AbsoluteY }, { 0xDD, "CMP", Mode::AbsoluteX }, { 0xDE, "DEC", Mode::AbsoluteX },
+            { 0xE0, "CPX", Mode::Immediate }, { 0xE1, "SBC", Mode::IndirectX }, { 0xE4, "CPX", Mode::ZeroPage },
+            { 0xE5, "SBC", Mode::ZeroPage }, { 0xE6, "INC", Mode::ZeroPage }, { 0xE8, "INX", Mode::Implied },
+            { 0xE9, "SBC", Mode::Immediate }, { 0xEA, "NOP", Mode::Implied }, { 0xEC, "CPX", Mode::Absolute },
+            { 0xED, "SBC", Mode::Absolute }, { 0xEE, "INC", Mode::Absolute }, { 0xF0, "BEQ", Mode::Relative },
+            { 0xF1, "SBC", Mode::IndirectY }, { 0xF5, "SBC", Mode::ZeroPageX }, { 0xF6, "INC", Mode::ZeroPageX },
+            { 0xF8, "SED", Mode::Implied }, { 0xF9, "SBC", Mode::AbsoluteY }, { 0xFD, "SBC", Mode::AbsoluteX },
+            { 0xFE, "INC", Mode::AbsoluteX },
+        };
+        for (const auto& o : OPCODES)
+        {
+            opcodes[o.code].name = o.name;
+            opcodes[o.code].mode = o.mode;
+        }
+    }
+
+    Word PeekWord(const Word addr) const
+    {
+        return bus->Peek(addr) | bus->Peek(addr + 1) << 8;
+    }
+
+    // Only ROM holds code that's there before the program runs
+    bool InRom(const Word addr) const
+    {
+        return bus->memory[addr >> 8] != nullptr && !bus->writable[addr >> 8];
+    }
+
+    static bool IsBranch(const Byte op)
+    {
+        return (op & 0x1F) == 0x10;
+    }
+
+    // Indexed reads take a cycle more when the index crosses a page, stores and read-modify-writes always take it
+    bool MayCross(const Byte op) const
+    {
+        const Mode mode = opcodes[op].mode;
+        return ((mode == Mode::AbsoluteX || mode == Mode::AbsoluteY) && CPU6502::CYCLES[op] == 4) || (mode == Mode::IndirectY && CPU6502::CYCLES[op] == 5);
+    }
+
+    static Byte Size(const Mode mode)
+    {
+        switch (mode)
+        {
+            case Mode::Implied:
+            case Mode::Accumulator:
+                return 1;
+            case Mode::Absolute:
+            case Mode::AbsoluteX:
+            case Mode::AbsoluteY:
+            case Mode::Indirect:
+                return 3;
+            default:
+                return 2;
+        }
+    }
+
+    std::string Label(const Word addr) const
+    {
+        if (debugInfo != nullptr)
+        {
+            const DebugInfo::Symbol* symbol = debugInfo->FindSymbol(addr);
+            if (symbol != nullptr && symbol->addr == addr) return debugInfo->names.c_str() + symbol->name;
+        }
+        char s[8];
+        snprintf(s, sizeof(s), "$%04X", addr);
+        return s;
+    }
+
+    // Decodes everything reachable from the vectors, every JSR target starts a routine
+    void Disassemble()
+    {
+        static const char* VECTOR_NAMES[3] = { "reset", "nmi", "irq" };
+        const Word VECTOR_ADDRESSES[3] = { 0xFFFC, 0xFFFA, 0xFFFE };
+
+        std::vector<Word> work;
+        for (int i = 0; i < 3; i++)
+        {
+            vectors[i] = PeekWord(VECTOR_ADDRESSES[i]);
+            if (!InRom(vectors[i])) continue;
+            Routine& r = routines[vectors[i]];
+            if (r.name.empty()) r.name = Label(vectors[i]).front() == '$' ? VECTOR_NAMES[i] : Label(vectors[i]);
+            work.push_back(vectors[i]);
+        }
+
+        while (!work.empty())
+        {
+            const Word addr = work.back();
+            work.pop_back();
+            if (code.count(addr) || !InRom(addr)) continue;
+
+            Instruction in;
+            in.op = bus->Peek(addr);
+            in.size = opcodes[in.op].name ? Size(opcodes[in.op].mode) : 1;
+            in.operand = in.size == 3 ? PeekWord(addr + 1) : in.size == 2 ? bus->Peek(addr + 1) : 0;
+            code[addr] = in;
+
+            if (in.op == 0x20 && InRom(in.operand) && !routines.count(in.operand))
+            {
+                routines[in.operand].name = Label(in.operand).front() == '$' ? "sub_" + Label(in.operand).substr(1) : Label(in.operand);
+            }
+            for (const int next : Successors(addr, in, true))
+            {
+                work.push_back(next);
+            }
+        }
+
+        for (auto& entry : routines)
+        {
+            FindBody(entry.first, entry.second);
+        }
+    }
+
+    // Where execution can go next, calls included or (for a routine's own body) just the return point
+    std::vector<int> Successors(const Word addr, const Instruction& in, const bool calls) const
+    {
+        const Word next = addr + in.size;
+        if (opcodes[in.op].name == nullptr) return {};
+        if (IsBranch(in.op)) return { next, static_cast<Word>(next + static_cast<int8_t>(in.operand)) };
+        switch (in.op)
+        {
+            case 0x4C: // JMP
+                return { in.operand };
+            case 0x6C: // JMP (ind)
+            case 0x60: // RTS
+            case 0x40: // RTI
+                return {};
+            case 0x20: // JSR
+                if (calls) return { next, in.operand };
+                return { next };
+            case 0x00: // BRK comes back after its padding byte, if there's an IRQ handler to come back from
+                if (!InRom(vectors[2])) return {};
+                return { static_cast<Word>(next + 1) };
+            default:
+                return { next };
+        }
+    }
+
+    void FindBody(const Word entry, Routine& r) const
+    {
+        std::vector<Word> work = { entry };
+        std::vector<bool> seen(0x10000);
+        while (!work.empty())
+        {
+            const Word addr = work.back();
+            work.pop_back();
+            if (seen[addr] || !code.count(addr)) continue;
+            seen[addr] = true;
+            r.body.push_back(addr);
+            for (const int next : Successors(addr, code.at(addr), false)) work.push_back(next);
+        }
+        std::sort(r.body.begin(), r.body.end());
+    }
+
+    std::vector<Edge> Edges(const Word addr, Routine& r)
+    {
+        const Instruction& in = code.at(addr);
+        const Word next = addr + in.size;
+        const Cycles cycles = CPU6502::CYCLES[in.op];
+        char why[64];
+
+        // Anywhere outside ROM (i.e. code copied to RAM) can't be followed
+        for (const int to : Successors(addr, in, true))
+        {
+            if (!code.count(to))
+            {
+                snprintf(why, sizeof(why), "leaves ROM at $%04X", addr);
+                if (r.unbounded.empty()) r.unbounded = why;
+                return {};
+            }
+        }
+
+        if (opcodes[in.op].name == nullptr)
+        {
+            snprintf(why, sizeof(why), "illegal opcode at $%04X", addr);
+            if (r.unbounded.empty()) r.unbounded = why;
+            return {};
+        }
+        if (IsBranch(in.op))
+        {
+            const Word target = next + static_cast<int8_t>(in.operand);
+            const Cycles taken = cycles + 1 + ((target & 0xFF00) != (next & 0xFF00));
+            return { { next, cycles, cycles }, { target, taken, taken } };
+        }
+        switch (in.op)
+        {
+            case 0x6C:
+                snprintf(why, sizeof(why), "indirect jump at $%04X", addr);
+                if (r.unbounded.empty()) r.unbounded = why;
+                return {};
+            case 0x60:
+            case 0x40:
+                return { { EXIT, cycles, cycles } };
+            case 0x20:
+            case 0x00:
+            {
+                // Calls cost the callee too, BRK runs the IRQ handler
+                if (!routines.count(in.op == 0x20 ? in.operand : vectors[2]))
+                {
+                    snprintf(why, sizeof(why), "%s with nothing to run at $%04X", opcodes[in.op].name, addr);
+                    if (r.unbounded.empty()) r.unbounded = why;
+                    return {};
+                }
+                Routine& callee = routines.at(in.op == 0x20 ? in.operand : vectors[2]);
+                Compute(in.op == 0x20 ? in.operand : vectors[2], callee);
+                if (!callee.returns) return {};
+                if (!callee.unbounded.empty() && r.unbounded.empty()) r.unbounded = callee.unbounded + " in " + callee.name;
+                const int to = in.op == 0x20 ? next : next + 1;
+                return { { to, cycles + callee.min, callee.max == UNBOUNDED ? UNBOUNDED : cycles + callee.max } };
+            }
+            default:
+                return { { in.op == 0x4C ? in.operand : next, cycles, cycles + MayCross(in.op) } };
+        }
+    }
+
+    // Fewest cycles is a shortest path to EXIT, most is a longest path, which needs the graph to have no cycles
+    void Compute(const Word entry, Routine& r)
+    {
+        if (r.computed) return;
+        if (r.computing)
+        {
+            // Recursion, the inner call is unbounded and assumed to return
+            r.returns = true;
+            r.max = UNBOUNDED;
+            if (r.unbounded.empty()) r.unbounded = "recursion through " + r.name;
+            return;
+        }
+        r.computing = true;
+
+        std::map<int, std::vector<Edge>> graph;
+        for (const Word addr : r.body)
+        {
+            graph[addr] = Edges(addr, r);
+        }
+
+        // Dijkstra for the minimum
+        std::map<int, Cycles> best;
+        std::vector<std::pair<Cycles, int>> heap = { { 0, entry } };
+        while (!heap.empty())
+        {
+            std::pop_heap(heap.begin(), heap.end(), std::greater<std::pair<Cycles, int>>());
+            const auto [cost, node] = heap.back();
+            heap.pop_back();
+            if (best.count(node)) continue;
+            best[node] = cost;
+            if (node == EXIT) break;
+            for (const Edge& e : graph[node])
+            {
+                if (best.count(e.to)) continue;
+                heap.push_back({ cost + e.min, e.to });
+                std::push_heap(heap.begin(), heap.end(), std::greater<std::pair<Cycles, int>>());
+            }
+        }
+        r.returns = best.count(EXIT) > 0;
+        r.min = r.returns ? best[EXIT] : 0;
+
+        // Longest path over the nodes that can still reach EXIT, a cycle among them is a loop that can go round any number of times
+        std::map<int, std::vector<int>> predecessors;
+        for (const auto& node : graph)
+        {
+            for (const Edge& e : node.second) predecessors[e.to].push_back(node.first);
+        }
+        std::set<int> exits = { EXIT };
+        std::vector<int> work = { EXIT };
+        while (!work.empty())
+        {
+            const int node = work.back();
+            work.pop_back();
+            for (const int p : predecessors[node])
+            {
+                if (exits.insert(p).second) work.push_back(p);
+            }
+        }
+
+        std::map<int, Cycles> longest;
+        std::map<int, int> choice;
+        std::map<int, int> state; // 1 = on the DFS stack, 2 = done
+        const std::function<Cycles(int)> visit = [&](const int node) -> Cycles
+        {
+            if (node == EXIT) return 0;
+            if (state[node] == 2) return longest[node];
+            if (state[node] == 1)
+            {
+                char why[32];
+                snprintf(why, sizeof(why), "loop at $%04X", node);
+                if (r.unbounded.empty()) r.unbounded = why;
+                return UNBOUNDED;
+            }
+
+            state[node] = 1;
+            Cycles most = 0;
+            for (const Edge& e : graph[node])
+            {
+                if (!exits.count(e.to)) continue;
+                const Cycles rest = visit(e.to);
+                const Cycles total = e.max == UNBOUNDED || rest == UNBOUNDED ? UNBOUNDED : e.max + rest;
+                if (!choice.count(node) || total > most)
+                {
+                    most = total;
+                    choice[node] = e.to;
+                }
+            }
+            state[node] = 2;
+            longest[node] = most;
+            return most;
+        };
+        r.max = r.returns ? visit(entry) : 0;
+        if (!r.unbounded.empty()) r.max = UNBOUNDED;
+
+        for (int node = entry; r.returns && node != EXIT && r.worst.size() < r.body.size() && choice.count(node); node = choice[node])
+        {
+            r.worst.push_back(node);
+        }
+
+        r.computing = false;
+        r.computed = true;
+    }
+
+    std::string Operand(const Word addr, const Instruction& in) const
+    {
+        char s[32];
+        const std::string label = Label(in.operand);
+        switch (opcodes[in.op].mode)
+        {
+            case Mode::Implied: return "";
+            case Mode::Accumulator: return "A";
+            case Mode::Immediate: snprintf(s, sizeof(s), "#$%02X", in.operand); return s;
+            case Mode::ZeroPage: snprintf(s, sizeof(s), "$%02X", in.operand); return s;
+            case Mode::ZeroPageX: snprintf(s, sizeof(s), "$%02X,X", in.operand); return s;
+            case Mode::ZeroPageY: snprintf(s, sizeof(s), "$%02X,Y", in.operand); return s;
+            case Mode::Absolute: return label;
+            case Mode::AbsoluteX: return label + ",X";
+            case Mode::AbsoluteY: return label + ",Y";
+            case Mode::Indirect: return "(" + label + ")";
+            case Mode::IndirectX: snprintf(s, sizeof(s), "($%02X,X)", in.operand); return s;
+            case Mode::IndirectY: snprintf(s, sizeof(s), "($%02X),Y", in.operand); return s;
+            case Mode::Relative: return Label(addr + 2 + static_cast<int8_t>(in.operand));
+        }
+        return "";
+    }
+
+    static std::string Cost(const Cycles c)
+    {
+        return c == UNBOUNDED ? "unbounded" : std::to_string(c);
+    }
+
+    // Each routine with its costs and disassembly
+    void Report(std::ostream& out)
+    {
+        for (auto& entry : routines)
+        {
+            Routine& r = entry.second;
+            Compute(entry.first, r);
+
+            out << "; " << r.name << " $" << std::hex << std::setw(4) << entry.first << std::dec << "  ";
+            if (!r.returns) out << "never returns";
+            else out << "min " << r.min << "  max " << Cost(r.max) << " cycles";
+            if (!r.unbounded.empty()) out << "  (" << r.unbounded << ")";
+            out << "\n";
+
+            for (const Word addr : r.body)
+            {
+                const Instruction& in = code.at(addr);
+                if (addr != entry.first && Label(addr).front() != '$') out << Label(addr) << ":\n";
+
+                char line[32];
+                snprintf(line, sizeof(line), "%04X  ", addr);
+                out << line;
+                for (int i = 0; i < 3; i++)
+                {
+                    if (i < in.size) snprintf(line, sizeof(line), "%02X ", bus->Peek(addr + i));
+                    else snprintf(line, sizeof(line), "   ");
+                    out << line;
+                }
+                out << " " << (opcodes[in.op].name ? opcodes[in.op].name : "???") << " " << Operand(addr, in) << "\n";
+            }
+            out << "\n";
+        }
+    }
+
+    // Budget is reset/irq/nmi, a symbol or a hex address, then ':' and the cycles, returns false if it's over
+    bool Check(const std::string& budget, std::ostream& out)
+    {
+        const size_t colon = budget.rfind(':');
+        char* end = nullptr;
+        const Cycles limit = colon == std::string::npos ? 0 : std::strtoull(budget.c_str() + colon + 1, &end, 10);
+        if (colon == std::string::npos || !isdigit(static_cast<unsigned char>(budget[colon + 1])) || *end != 0)
+        {
+            out << "Budget " << budget << " needs a cycle count (<routine>:<cycles>)\n";
+            return false;
+        }
+        const std::string name = budget.substr(0, colon);
+
+        Word entry = 0;
+        if (name == "reset") entry = vectors[0];
+        else if (name == "nmi") entry = vectors[1];
+        else if (name == "irq") entry = vectors[2];
+        else if (debugInfo == nullptr || !debugInfo->FindAddress(name, entry))
+        {
+            // Not a symbol, so it has to be a whole hex address
+            const unsigned long addr = std::strtoul(name.c_str(), &end, 16);
+            if (name.empty() || *end != 0 || addr > 0xFFFF)
+            {
+                out << "No routine at " << name << "\n";
+                return false;
+            }
+            entry = static_cast<Word>(addr);
+        }
+
+        if (!routines.count(entry))
+        {
+            out << "No routine at " << name << "\n";
+            return false;
+        }
+        Routine& r = routines[entry];
+        Compute(entry, r);
+        if (r.returns && r.max <= limit) return true;
+
+        out << "Over budget: " << r.name << " worst case " << (r.returns ? Cost(r.max) : "never returns") << " > " << limit << " cycles";
+        if (!r.unbounded.empty()) out << " (" << r.unbounded << ")";
+        out << "\n";
+
+        // The longest path a block at a time (every branch shows which way it went), with what each call can cost
+        if (r.max != UNBOUNDED && !r.worst.empty())
+        {
+            out << "  " << Label(r.worst.front());
+            for (size_t i = 0; i < r.worst.size(); i++)
+            {
+                const Instruction& in = code.at(r.worst[i]);
+                if (in.op == 0x20) out << " [" << routines.at(in.operand).name << " " << Cost(routines.at(in.operand).max) << "]";
+                if (i + 1 < r.worst.size() && (IsBranch(in.op) || r.worst[i + 1] != r.worst[i] + in.size)) out << " -> " << Label(r.worst[i + 1]);
+            }
+            out << " -> " << opcodes[code.at(r.worst.back()).op].name << "\n";
+        }
+        return false;
+    }
+};
+
+// Several boards in one process (--machines=<rom>,<rom>,...), each on its own thread, their ACIAs linked in a ring
+// (--topology=ring, each one's output goes to the next) or in pairs (--topology=pairs, 0 <-> 1, 2 <-> 3...)
+// They keep in step conservatively: every machine runs a quantum of cycles (--quantum=) and waits at a barrier, and
+// the last one to arrive moves what each ACIA sent into the receiving ACIA while the rest are still waiting.
+// A byte takes until the next quantum to arrive, so for a given quantum the run is deterministic
+// Bytes the receiver hasn't made room for stay queued in the sender's ACIA, in order, and once that fills up
+// the sending program sees TDRE stay clear like on a real link. The barrier is a spin on a counter, so nothing takes a lock
+struct Network
+{
+    std::vector<std::unique_ptr<Machine>> machines;
+    std::vector<int> peers; // Where each machine's serial output goes, -1 for nowhere
+    std::vector<uint64_t> sent;
+    std::vector<uint64_t> received;
+
+    Cycles quantum = 10000;
+    Cycles limit = Scheduler::NEVER;
+
+    std::atomic<int> arrived{0};
+    std::atomic<uint> generation{0};
+    bool stopping = false;
+
+    bool Build(const std::vector<std::string>& roms, const std::string& topology, const size_t bankedRam)
+    {
+        const int n = roms.size();
+        for (int i = 0; i < n; i++)
+        {
+            machines.emplace_back(new Machine(bankedRam));
+            machines.back()->Load(roms[i]);
+            machines.back()->cpu.Reset();
+
+            if (topology == "ring") peers.push_back(n > 1 ? (i + 1) % n : -1);
+            else if (topology == "pairs") peers.push_back((i ^ 1) < n ? i ^ 1 : -1);
+            else return false;
+            // Without a peer nothing would empty tx, so it behaves like an unconnected ACIA
+            machines.back()->acia.drained = peers.back() >= 0;
+        }
+        sent.assign(n, 0);
+        received.assign(n, 0);
+        return true;
+    }
+
+    // Everyone waits for the last machine to finish the quantum, which decides whether there's another one
+    bool Sync(const Cycles reached)
+    {
+        const uint g = generation.load(std::memory_order_acquire);
+        if (arrived.fetch_add(1, std::memory_order_acq_rel) + 1 == static_cast<int>(machines.size()))
+        {
+            arrived.store(0, std::memory_order_relaxed);
+            Deliver();
+            stopping = !running || reached >= limit;
+            generation.store(g + 1, std::memory_order_release);
+        }
+        else
+        {
+            while (generation.load(std::memory_order_acquire) == g) std::this_thread::yield();
+        }
+        return !stopping;
+    }
+
+    // Only run by the last machine to reach the barrier, the others are waiting so every ACIA's queues are safe to touch
+    void Deliver()
+    {
+        for (size_t i = 0; i < machines.size(); i++)
+        {
+            if (peers[i] < 0) continue;
+
+            ACIA& from = machines[i]->acia;
+            ACIA& to = machines[peers[i]]->acia;
+            Byte b;
+            while (!to.rx.Full() && from.tx.Pop(b))
+            {
+                to.rx.Push(b);
+                sent[i]++;
+                received[peers[i]]++;
+            }
+        }
+    }
+
+    void Run(const int i)
+    {
+        Machine& m = *machines[i];
+        Cycles end = 0;
+        do
+        {
+            // Quanta end at fixed cycles, whatever the last instruction overran by
+            end = std::min(end + quantum, limit);
+            if (m.cpu.numCycles < end) m.cpu.Execute(end - m.cpu.numCycles);
+        }
+        while (Sync(end));
+    }
+
+    void Start()
+    {
+        std::vector<std::thread> threads;
+        for (size_t i = 0; i < machines.size(); i++)
+        {
+            threads.emplace_back(&Network::Run, this, static_cast<int>(i));
+        }
+        for (std::thread& t : threads)
+        {
+            t.join();
+        }
+    }
+
+    void Report() const
+    {
+        for (size_t i = 0; i < machines.size(); i++)
+        {
+            const CPU6502& cpu = machines[i]->cpu;
+            const Bus& bus = machines[i]->bus;
+            char line[160];
+            snprintf(line, sizeof(line), "Machine %zu: %llu cycles, %llu bytes sent, %llu received, A=%02X X=%02X Y=%02X PC=%04X, RAM %016llx",
+                i, cpu.numCycles, static_cast<unsigned long long>(sent[i]), static_cast<unsigned long long>(received[i]), cpu.A, cpu.X, cpu.Y, cpu.PC,
+                static_cast<unsigned long long>(Hash64(bus.ram.data, sizeof(bus.ram.data))));
+            std::cout << line << std::endl;
+        }
+    }
+};
+
+// Runs the CPU and GPU on the calling thread, one frame at a time
+// Stops after maxFrames frames when it isn't 0
+void RunLockstep(CPU6502* cpu, GPU* gpu, FrameHasher* hasher, const uint maxFrames)
+{
+    uint frames = 0;
+
+    gpu->Init();
+
+    // Frame boundaries are absolute so cycles an instruction runs over are taken out of the next frame
+    Cycles frameEnd = cpu->numCycles;
+    auto nextFrame = std::chrono::steady_clock::now();
+
+    while (running)
+    {
+        gpu->PollEvents();
+
+        frameEnd += CyclesPerFrame();
+        if (cpu->numCycles < frameEnd)
+        {
+            cpu->Execute(frameEnd - cpu->numCycles);
+        }
+
+        if (hasher->Enabled() && !hasher->Frame(cpu->numCycles))
+        {
+            running = false;
+        }
+        if (++frames == maxFrames)
+        {
+            running = false;
+        }
+
+        gpu->Frame();
+
+        if (!turbo)
+        {
+            nextFrame += std::chrono::microseconds(static_cast<long long>(FramePeriod() * 1000.0f));
+            const auto start = std::chrono::steady_clock::now();
+            std::this_thread::sleep_until(nextFrame);
+            cpu->pacingNs += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+        }
+        else
+        {
+            nextFrame = std::chrono::steady_clock::now();
+        }
+    }
+}
+
+#ifndef LIBFUZZER
+int main(int argc, char** argv)
+{
+    // Format console
+    std::cout << std::internal << std::setfill('0') << std::uppercase;
+
+    // Lets headless runs be stopped cleanly so captures get finished
+    std::signal(SIGINT, [](int) { running = false; });
+
+    std::string capturePath;
+    float terminalFps = 0;
+    std::string gdbAddress;
+    std::string heatmapPath;
+    std::string aciaConnection;
+    std::string sdImage;
+    std::string nvramPath;
+    Fusion::Mode fuse = Fusion::Auto;
+    std::string pairProfilePath;
+    bool nvramVram = false;
+    int nvramSync = NVRAM::SYNC_ON_EXIT;
+    std::string coveragePath;
+    std::string debugInfoPath;
+    std::string labelsPath;
+    std::string tracePath;
+    std::string telemetryName;
+    bool telemetryOverlay = false;
+    std::string hashPath;
+    std::string goldenPath;
+    std::string romPath = "../program.bin";
+    bool watchRom = false;
+    std::string recordPath;
+    std::string replayPath;
+    size_t bankedRam = 512 * 1024;
+    std::string bankedRom;
+    std::string wavPath;
+    bool analyze = false;
+    std::vector<std::string> budgets;
+    std::vector<std::string> networkRoms;
+    std::string topology = "ring";
+    Cycles quantum = 10000;
+    uint maxFrames = 0;
+    bool exactAll = false;
+    bool exactPages[256] = {};
+    for (int i = 1; i < argc; i++)
+    {
+        const std::string arg = argv[i];
+        if (arg == "--lockstep")
+        {
+            lockstep = true;
+        }
+        else if (arg == "--turbo")
+        {
+            turbo = true;
+        }
+        else if (arg.rfind("--resolution=", 0) == 0)
+        {
+            sscanf(arg.c_str(), "--resolution=%dx%d", &videoMode.width, &videoMode.height);
+        }
+        else if (arg.rfind("--stride=", 0) == 0)
+        {
+            videoMode.stride = std::stoi(arg.substr(9), nullptr, 0);
+        }
+        else if (arg.rfind("--vram-base=", 0) == 0)
+        {
+            videoMode.base = std::stoi(arg.substr(12), nullptr, 0);
+        }
+        else if (arg.rfind("--pages=", 0) == 0)
+        {
+            videoMode.pages = std::max(1, std::stoi(arg.substr(8)));
+        }
+        else if (arg == "--indexed")
+        {
+            videoMode.format = PixelFormat::Indexed;
+        }
+        else if (arg == "--exact")
+        {
+            exactAll = true;
+        }
+        else if (arg.rfind("--exact=", 0) == 0)
+        {
+            // --exact=<from>-<to>, the pages covering the range run on the cycle-exact core
+            uint from, to;
+            if (sscanf(arg.c_str(), "--exact=%x-%x", &from, &to) == 2 && from <= to && to <= 0xFFFF)
+            {
+                for (uint page = from >> 8; page <= to >> 8; page++) exactPages[page] = true;
+            }
+            else
+            {
+                std::cout << "Bad range " << arg << std::endl;
+            }
+        }
+        else if (arg.rfind("--gdb=", 0) == 0)
+        {
+            gdbAddress = arg.substr(6);
+        }
+#ifdef HEATMAP
+        else if (arg.rfind("--heatmap=", 0) == 0)
+        {
+            heatmapPath = arg.substr(10);
+        }
+#endif
+        else if (arg.rfind("--acia=", 0) == 0)
+        {
+            aciaConnection = arg.substr(7);
+        }
+        else if (ParseFuzzOption(arg))
+        {
+            headless = true;
+        }
+        else if (arg.rfind("--coverage=", 0) == 0)
+        {
+            coveragePath = arg.substr(11);
+        }
+        else if (arg.rfind("--dbg=", 0) == 0)
+        {
+            debugInfoPath = arg.substr(6);
+        }
+        else if (arg.rfind("--labels=", 0) == 0)
+        {
+            labelsPath = arg.substr(9);
+        }
+        else if (arg.rfind("--trace=", 0) == 0)
+        {
+            tracePath = arg.substr(8);
+        }
+        else if (arg.rfind("--telemetry=", 0) == 0)
+        {
+            telemetryName = arg.substr(12);
+        }
+        else if (arg == "--telemetry-overlay")
+        {
+            telemetryOverlay = true;
+        }
+        else if (arg.rfind("--fuse=", 0) == 0)
+        {
+            const std::string mode = arg.substr(7);
+            if (mode == "off") fuse = Fusion::Off;
+            else if (mode == "all") fuse = Fusion::All;
+            else fuse = Fusion::Auto;
+        }
+        else if (arg.rfind("--pair-profile=", 0) == 0)
+        {
+            pairProfilePath = arg.substr(15);
+        }
+        else if (arg.rfind("--nvram=", 0) == 0)
+        {
+            nvramPath = arg.substr(8);
+        }
+        else if (arg == "--nvram-vram")
+        {
+            nvramVram = true;
+        }
+        else if (arg.rfind("--nvram-sync=", 0) == 0)
+        {
+            const std::string policy = arg.substr(13);
+            if (policy == "exit") nvramSync = NVRAM::SYNC_ON_EXIT;
+            else if (policy == "never") nvramSync = NVRAM::SYNC_NEVER;
+            else nvramSync = std::max(1, std::stoi(policy));
+        }
+        else if (arg.rfind("--sd=", 0) == 0)
+        {
+            sdImage = arg.substr(5);
+        }
+        else if (arg.rfind("--rom=", 0) == 0)
+        {
+            romPath = arg.substr(6);
+        }
+        else if (arg == "--watch")
+        {
+            watchRom = true;
+        }
+        else if (arg.rfind("--banked-ram=", 0) == 0)
+        {
+            // KiB
+            bankedRam = std::stoul(arg.substr(13)) * 1024;
+        }
+        else if (arg.rfind("--banked-rom=", 0) == 0)
+        {
+            bankedRom = arg.substr(13);
+        }
+        else if (arg.rfind("--machines=", 0) == 0)
+        {
+            std::stringstream roms(arg.substr(11));
+            std::string rom;
+            while (std::getline(roms, rom, ',')) networkRoms.push_back(rom);
+            headless = true;
+        }
+        else if (arg.rfind("--topology=", 0) == 0)
+        {
+            topology = arg.substr(11);
+        }
+        else if (arg.rfind("--quantum=", 0) == 0)
+        {
+            quantum = std::stoull(arg.substr(10));
+        }
+        else if (arg == "--analyze")
+        {
+            analyze = true;
+        }
+        else if (arg.rfind("--budget=", 0) == 0)
+        {
+            budgets.push_back(arg.substr(9));
+            analyze = true;
+        }
+        else if (arg.rfind("--wav=", 0) == 0)
+        {
+            wavPath = arg.substr(6);
+        }
+        else if (arg.rfind("--record=", 0) == 0)
+        {
+            recordPath = arg.substr(9);
+        }
+        else if (arg.rfind("--replay=", 0) == 0)
+        {
+            replayPath = arg.substr(9);
+        }
+        else if (arg == "--headless")
+        {
+            headless = true;
+        }
+        else if (arg == "--terminal" || arg.rfind("--terminal=", 0) == 0)
+        {
+            terminalFps = arg.size() > 11 ? std::stof(arg.substr(11)) : 30;
+            headless = true;
+        }
+        else if (arg.rfind("--capture=", 0) == 0)
+        {
+            capturePath = arg.substr(10);
+        }
+        else if (arg.rfind("--hash=", 0) == 0)
+        {
+            hashPath = arg.substr(7);
+            lockstep = true;
         }
-        else
+        else if (arg.rfind("--golden=", 0) == 0)
         {
-            Byte b = ReadByte(addr);
-
-            C = b & 0x01;
-            b >>= 1;
-
-            Z = b == 0;
-            N = b & 0x80;
-
-            WriteByte(addr, b);
+            goldenPath = arg.substr(9);
+            lockstep = true;
         }
-
-        Clock(1);
-    }
-
-    // Rotations
-    void ROL(const Word addr, const bool acc)
-    {
-        if (acc)
+        else if (arg.rfind("--frames=", 0) == 0)
         {
-            Byte temp = A;
-            temp <<= 1;
-            temp &= 0b11111110;
-            temp += C;
-            C = A >> 7;
-
-            A = temp;
-
-            Z = A == 0;
-            N = A & 0x80;
-            Clock(1);
+            maxFrames = std::stoul(arg.substr(9));
+            lockstep = true;
         }
-        else
+        else if (arg == "--vga-timing" || arg == "--vga-timing=scanline")
         {
-            const Byte b = ReadByte(addr);
-            Byte temp = b;
-            temp <<= 1;
-            temp &= 0b11111110;
-            temp += C;
-
-            C = b >> 7;
-
-            WriteByte(addr, temp);
-            Z = temp == 0;
-            N = temp & 0x80;
-            Clock(1);
+            emulateVideoTiming = true;
         }
-    }
-
-    void ROR(const Word addr, const bool acc)
-    {
-        if (acc)
+        else if (arg == "--vga-timing=frame")
         {
-            Byte temp = A;
-            temp >>= 1;
-            temp &= 0b01111111;
-            temp += C << 7;
-            C = A & 1;
-
-            A = temp;
-
-            Z = A == 0;
-            N = A & 0x80;
-            Clock(1);
+            emulateVideoTiming = true;
+            haltPerScanline = false;
         }
         else
         {
-            const Byte b = ReadByte(addr);
-            Byte temp = b;
-            temp >>= 1;
-            temp &= 0b01111111;
-            temp += C << 7;
-
-            C = b & 1;
-
-            WriteByte(addr, temp);
-            Z = temp == 0;
-            N = temp & 0x80;
-            Clock(1);
+            std::cout << "Unknown option " << arg << std::endl;
         }
     }
 
-    // Jumps/Subroutines
-    void JMP(const Word addr)
+    if (!networkRoms.empty())
     {
-        PC = addr;
+        Network network;
+        network.quantum = std::max(1ull, quantum);
+        if (maxFrames != 0) network.limit = maxFrames * CyclesPerFrame();
+        if (!network.Build(networkRoms, topology, bankedRam))
+        {
+            std::cout << "Unknown topology " << topology << std::endl;
+            return 1;
+        }
+        network.Start();
+        network.Report();
+        return 0;
     }
 
-    void JSR(const Word addr)
+    NVRAM nvram;
+    nvram.vram = nvramVram;
+    nvram.syncPeriod = nvramSync;
+    if (!nvramPath.empty() && !nvram.Open(nvramPath))
     {
-        PC--;
+        std::cout << "Couldn't open NVRAM file " << nvramPath << std::endl;
+        return 1;
+    }
 
-        WriteWord(SPToAddress() - 1, PC);
-        SP -= 2;
+    Machine machine(bankedRam, &nvram);
+    Bus& bus = machine.bus;
+    CPU6502& cpu = machine.cpu;
+    cpu.debug = false;
+    cpu.exact = exactAll;
+    std::copy(std::begin(exactPages), std::end(exactPages), cpu.exactPages);
+    cpu.fusion.Start(fuse, !pairProfilePath.empty());
+    Screen screen;
+    VideoControl& videoControl = machine.videoControl;
+    GPU gpu(&bus, &screen, &cpu, &videoControl);
+    VideoHalt videoHalt(&cpu);
+    VideoCapture capture;
+    FrameHasher hasher(&bus, &videoControl);
+    Debugger debugger(&cpu, &bus);
+    ACIA& acia = machine.acia;
+    SDCard& sd = machine.sd;
+    MMU& mmu = machine.mmu;
+    PSG& psg = machine.psg;
+    Keyboard& keyboard = machine.keyboard;
+    gpu.keyboard = &keyboard;
 
-        PC = addr;
-        Clock(1);
-    }
+    // Load a program
+    machine.Load(romPath);
+    //std::fill(std::begin(bus.vram.data), std::end(bus.vram.data), 0xFF);
 
-    void RTS()
+    Coverage coverage;
+    DebugInfo debugInfo;
+    if (!coveragePath.empty() || (fuzzConfig.enabled && coverage.OpenShared()))
     {
-        SP++;
-        PC = ReadByte(SPToAddress());
-        SP++;
-        PC |= ReadByte(SPToAddress()) << 8;
-        PC++;
-        Clock(3);
+        cpu.coverage = &coverage;
     }
-
-    // Branches
-    void BEQ(const Word addr)
+    if (!debugInfoPath.empty() && !debugInfo.Load(debugInfoPath))
     {
-        if (Z == 1)
-        {
-            Clock(1);
-
-            if ((addr & 0xFF00) != (PC & 0xFF00))
-            {
-                Clock(1);
-            }
-
-            PC = addr;
-        }
+        std::cout << "Couldn't load debug info from " << debugInfoPath << std::endl;
+        return 1;
     }
-
-    void BNE(const Word addr)
+    if (!labelsPath.empty() && !debugInfo.LoadLabels(labelsPath))
     {
-        if (Z == 0)
-        {
-            Clock(1);
-
-            if ((addr & 0xFF00) != (PC & 0xFF00))
-            {
-                Clock(1);
-            }
-
-            PC = addr;
-        }
+        std::cout << "Couldn't load labels from " << labelsPath << std::endl;
+        return 1;
     }
-
-    void BCS(const Word addr)
+    if (!debugInfo.Empty())
     {
-        if (C == 1)
-        {
-            Clock(1);
-
-            if ((addr & 0xFF00) != (PC & 0xFF00))
-            {
-                Clock(1);
-            }
-
-            PC = addr;
-        }
+        cpu.debugInfo = &debugInfo;
+        debugger.debugInfo = &debugInfo;
     }
-
-    void BCC(const Word addr)
+    std::ofstream trace;
+    if (!tracePath.empty())
     {
-        if (C == 0)
-        {
-            Clock(1);
-
-            if ((addr & 0xFF00) != (PC & 0xFF00))
-            {
-                Clock(1);
-            }
-
-            PC = addr;
-        }
+        trace.open(tracePath);
+        cpu.trace = &trace;
     }
 
-    void BPL(const Word addr)
+    if (analyze)
     {
-        if (N == 0)
+        Analyzer analyzer(&bus, debugInfo.Empty() ? nullptr : &debugInfo);
+        analyzer.Disassemble();
+        analyzer.Report(std::cout);
+        bool ok = true;
+        for (const std::string& budget : budgets)
         {
-            Clock(1);
-
-            if ((addr & 0xFF00) != (PC & 0xFF00))
-            {
-                Clock(1);
-            }
-
-            PC = addr;
+            ok = analyzer.Check(budget, std::cout) && ok;
         }
+        return ok ? 0 : 1;
     }
 
-    void BMI(const Word addr)
+    cpu.Reset();
+    if (fuzzConfig.enabled)
     {
-        if (N == 1)
+        Fuzzer fuzzer(&cpu, &bus);
+        fuzzer.mmu = &mmu;
+        const int result = RunFuzzer(&fuzzer);
+        if (!coveragePath.empty() && !WriteCoverage(coverage, debugInfo.lines.empty() ? nullptr : &debugInfo, coveragePath))
         {
-            Clock(1);
-
-            if ((addr & 0xFF00) != (PC & 0xFF00))
-            {
-                Clock(1);
-            }
-
-            PC = addr;
+            std::cout << "Couldn't write coverage to " << coveragePath << std::endl;
         }
+        return result;
     }
-
-    void BVC(const Word addr)
+    if (emulateVideoTiming)
     {
-        if (V == 0)
-        {
-            Clock(1);
-
-            if ((addr & 0xFF00) != (PC & 0xFF00))
-            {
-                Clock(1);
-            }
-
-            PC = addr;
-        }
+        videoHalt.Attach();
     }
-
-    void BVS(const Word addr)
+    if (!capturePath.empty() && capture.Start(capturePath))
     {
-        if (V == 1)
-        {
-            Clock(1);
-
-            if ((addr & 0xFF00) != (PC & 0xFF00))
-            {
-                Clock(1);
-            }
-
-            PC = addr;
-        }
+        gpu.capture = &capture;
     }
-
-    // Interrupts
-    void BRK()
+    TerminalScreen terminal;
+    if (terminalFps > 0)
     {
-        WriteWord(SPToAddress() - 1, PC + 1);
-        SP -= 2;
-
-        PHP();
-        B = true;
-
-        // Read IRQ interrupt vector
-        PC = ReadWord(0xFFFE);
+        terminal.fps = terminalFps;
+        terminal.Init();
+        gpu.terminal = &terminal;
     }
-
-    void RTI()
+    if (!aciaConnection.empty() && !acia.Open(aciaConnection))
     {
-        SP++;
-        const Byte status = ReadByte(SPToAddress());
-        C = status & 0b00000001;
-        Z = status & 0b00000010;
-        I = status & 0b00000100;
-        D = status & 0b00001000;
-        V = status & 0b01000000;
-        N = status & 0b10000000;
-
-        SP++;
-        PC = ReadByte(SPToAddress());
-        SP++;
-        PC |= ReadByte(SPToAddress()) << 8;
-
-        Clock(2);
+        std::cout << "Couldn't connect the ACIA to " << aciaConnection << std::endl;
+        return 1;
     }
-
-    // Flags
-    void CLC()
+    if (!bankedRom.empty() && !mmu.LoadRom(bankedRom))
     {
-        C = false;
-        Clock(1);
+        std::cout << "Couldn't load banked ROM " << bankedRom << std::endl;
+        return 1;
     }
-
-    void SEC()
+    if (!wavPath.empty() && !psg.OpenWav(wavPath))
     {
-        C = true;
-        Clock(1);
+        std::cout << "Couldn't create " << wavPath << std::endl;
+        return 1;
     }
-
-    void CLD()
+    if (!headless && !psg.OpenAudio())
     {
-        D = false;
-        Clock(1);
+        std::cout << "No audio device, running without sound" << std::endl;
     }
-
-    void SED()
+    if (!sdImage.empty() && !sd.Open(sdImage))
     {
-        D = true;
-        Clock(1);
+        std::cout << "Couldn't open SD card image " << sdImage << std::endl;
+        return 1;
     }
-
-    void CLI()
+    if (!gdbAddress.empty())
     {
-        I = false;
-        Clock(1);
+        if (!debugger.Listen(gdbAddress))
+        {
+            std::cout << "Couldn't listen for GDB on " << gdbAddress << std::endl;
+            return 1;
+        }
+        debugger.Attach();
     }
-
-    void SEI()
+    InputLog inputLog;
+    if (!recordPath.empty() || !replayPath.empty())
     {
-        I = true;
-        Clock(1);
+        // A reload swaps in a ROM from outside the log
+        if (watchRom)
+        {
+            std::cout << "--watch can't be used while recording or replaying" << std::endl;
+            return 1;
+        }
+        if (!recordPath.empty() && !replayPath.empty())
+        {
+            std::cout << "--record and --replay can't be used together" << std::endl;
+            return 1;
+        }
+        if (!recordPath.empty() && !inputLog.Record(recordPath))
+        {
+            std::cout << "Couldn't create " << recordPath << std::endl;
+            return 1;
+        }
+        if (!replayPath.empty() && !inputLog.Replay(replayPath))
+        {
+            std::cout << "Couldn't read a replay from " << replayPath << std::endl;
+            return 1;
+        }
+        cpu.inputLog = &inputLog;
+        inputLog.Attach(&cpu.scheduler);
     }
-
-    void CLV()
+    RomReloader reloader(&cpu, &bus);
+    reloader.mmu = &mmu;
+    if (watchRom)
     {
-        V = false;
-        Clock(1);
+        if (!reloader.Open(romPath))
+        {
+            std::cout << "Couldn't watch " << romPath << std::endl;
+            return 1;
+        }
+        reloader.Attach();
+        gpu.reloader = &reloader;
+        debugger.reloader = &reloader;
     }
-
-    // TODO: Add decimal flag support for math instructions
-    // Arithmetic
-    void ADC(const Byte b)
+    Telemetry telemetry;
+    if (!telemetryName.empty() || telemetryOverlay)
     {
-        const Word sum = b + A + C;
-
-        V = (A ^ sum) & (b ^ sum) & 0x0080;
-        C = sum & 0xFF00;
-        Z = (sum & 0x00FF) == 0;
-        N = sum & 0x0080;
-
-        A = sum & 0x00FF;
+        if (!telemetry.Open(telemetryName))
+        {
+            std::cout << "Couldn't create telemetry shared memory " << telemetryName << std::endl;
+            return 1;
+        }
+        telemetry.Attach(&cpu);
+        gpu.telemetry = &telemetry;
+        gpu.showTelemetry = telemetryOverlay;
     }
-
-    void SBC(const Byte b)
+    if (!hashPath.empty())
     {
-        ADC(b ^ 0x00FF);
+        hasher.out.open(hashPath);
     }
-};
-
-struct Screen
-{
-    int x = 0;
-    int y = 0;
-
-    void Draw(const Byte color)
+    if (!goldenPath.empty())
     {
-        SDL_SetRenderDrawColor(renderer, (color >> 4 & 0b11) / 3.0f * 255, (color >> 2 & 0b11) / 3.0f * 255, (color & 0b11) / 3.0f * 255, 255);
-        SDL_RenderDrawPoint(renderer, x, y);
-
-        x++;
-        if (x >= width)
+        hasher.golden.open(goldenPath);
+        if (!hasher.golden.is_open())
         {
-            y++;
-            x = 0;
-            if (y >= height)
-            {
-                y = 0;
-                SDL_RenderPresent(renderer);
-            }
+            std::cout << "Couldn't open golden file " << goldenPath << std::endl;
+            return 1;
         }
     }
-};
 
-struct GPU
-{
-    Bus* bus;
-
-    Screen* screen;
-    Byte x = 0;
-    Byte y = 0;
-
-    explicit GPU(Bus* bus, Screen* screen)
+    if (lockstep)
     {
-        this->bus = bus;
-        this->screen = screen;
+        RunLockstep(&cpu, &gpu, &hasher, maxFrames);
     }
-
-    void Run()
+    else
     {
-        SDL_Init(SDL_INIT_EVERYTHING);
-        SDL_CreateWindowAndRenderer(width*12, height*12, 0, &window, &renderer);
-        SDL_RenderSetScale(renderer, 12, 12);
-
-        while (running)
-        {
-            while(SDL_PollEvent(&e))
-            {
-                if (e.type == SDL_QUIT)
-                {
-                    running = false;
-                }
-            }
-
-            // first 3 bits are 011 to address the vram through the bus correctly, next 6 bits of addr are y val, last 7 are x val
-            // color is stored in a byte: 2 bits for each color -> 64 colors
-            screen->Draw(bus->ReadByte((0b011 << 13) + (y << 7) + x));
+        std::thread cpuThread(&CPU6502::Execute, &cpu, 1000000000000);
+        std::thread gpuThread(&GPU::Run, &gpu);
 
-            x++;
-            if (x >= width)
-            {
-                y++;
-                x = 0;
-                if (y >= height)
-                {
-                    y = 0;
-
-                    SDL_Delay(frameDelay);
-                }
-            }
-        }
+        cpuThread.join();
+        gpuThread.join();
     }
-};
-
-
-int main(int argc, char** argv)
-{
-    // Format console
-    std::cout << std::internal << std::setfill('0') << std::uppercase;
-
-    Bus bus;
-    CPU6502 cpu(&bus);
-    cpu.debug = false;
-    Screen screen;
-    GPU gpu(&bus, &screen);
-
-    // store rom and ram as files instead and read and write from them?
-    bus.ram.Initialize();
-    bus.rom.Initialize();
-    bus.vram.Initialize();
-
-    // Load a program
-    std::vector<Byte> prg;
-    std::ifstream f;
-    f.open("../program.bin", std::ios::binary | std::ios::in);
-
-    f >> std::noskipws;
-    if (f.fail())
+    capture.Stop();
+    terminal.Close();
+    debugger.Close();
+    acia.Close();
+    sd.Close();
+    nvram.Close();
+    psg.Close();
+    reloader.Close();
+    inputLog.Close(cpu.numCycles);
+    telemetry.Close();
+
+    if (!pairProfilePath.empty() && !cpu.fusion.WriteProfile(pairProfilePath))
     {
-        // err
+        std::cout << "Couldn't write the pair profile to " << pairProfilePath << std::endl;
     }
-
-    while (!f.eof())
+    if (!coveragePath.empty() && !WriteCoverage(coverage, debugInfo.lines.empty() ? nullptr : &debugInfo, coveragePath))
     {
-        Byte b;
-
-        f >> b;
-
-        if (f.fail())
-        {
-            // err
-            break;
-        }
-
-        prg.push_back(b);
+        std::cout << "Couldn't write coverage to " << coveragePath << std::endl;
     }
-    f.close();
-
-    bus.rom.Load(prg);
-    //std::fill(std::begin(bus.vram.data), std::end(bus.vram.data), 0xFF);
-
-    cpu.Reset();
-    std::thread cpuThread(cpu.Execute, &cpu, 1000000000000);
-    std::thread gpuThread(gpu.Run, &gpu);
 
-    cpuThread.join();
-    gpuThread.join();
+#ifdef HEATMAP
+    std::cout << "Stack peak: " << std::dec << cpu.heatmap.StackPeak() << " bytes" << std::endl;
+    if (!debugInfo.symbols.empty())
+    {
+        std::cout << std::endl << "Instructions per routine:" << std::endl;
+        cpu.heatmap.Profile(debugInfo, std::cout);
+    }
+    if (!heatmapPath.empty() && !cpu.heatmap.Dump(heatmapPath))
+    {
+        std::cout << "Couldn't write heatmap to " << heatmapPath << std::endl;
+    }
+#endif
 
     std::cout << std::endl << "Accumulator: " << std::hex << std::setw(2) << +cpu.A << std::endl;
     std::cout << "X: " << std::hex << std::setw(2) << +cpu.X << std::endl;
@@ -1598,5 +7772,11 @@ int main(int argc, char** argv)
 
     std::cout << std::endl << "N V D I Z C" << std::endl;
     std::cout << std::setw(1) << +cpu.N << " " << +cpu.V << " " << +cpu.D << " " << +cpu.I << " " << +cpu.Z << " " << +cpu.C << std::endl;
-    return 0;
+
+    if (hasher.Finish() && hasher.golden.is_open())
+    {
+        std::cout << std::endl << "Matched golden file for " << std::dec << hasher.frames << " frames" << std::endl;
+    }
+    return hasher.diverged ? 1 : 0;
 }
+#endif